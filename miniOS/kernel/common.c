@@ -7,3 +7,13 @@ size_t kstrlen(const char *s)
         n++;
     return n;
 }
+
+/* 1 if the two strings are the same */
+int kstreq(const char *a, const char *b)
+{
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
@@ -2,3 +2,4 @@
 #include <stddef.h>
 
 size_t kstrlen(const char *s);
+int    kstreq(const char *a, const char *b);
@@ -1,181 +1,472 @@
 #include "fs.h"
 #include "common.h"
+#include "kheap.h"
 #include "uart.h"
 
-static file_t files[MAX_FILES];
-static spinlock_t fs_lock;
+/* Locking: dir_lock is a reader-writer lock over the directory (files, file_count,
+dir_slots), so lookups run side by side and only fs_create excludes them. each file has
+its own lock for writers plus a seqlock, so readers of one file never wait on writers
+of another. fd_lock only covers taking and giving back descriptors, a descriptor itself
+belongs to the task that opened it. */
 
+/* file records come from a slab cache as they are created, in order */
+static file_t      *files[MAX_FILES];
+static int          file_count;
+static kmem_cache_t file_cache;
+static kmem_cache_t block_cache;
+static rwlock_t     dir_lock;
 
-/* this initializes the file subsystem, we need every entry to be consistent and we also need the spinlock so multiple tasks can't corrupt the FS.*/
+/* descriptors, free ones are chained through next_free */
+static open_file_t  open_files[MAX_OPEN_FILES];
+static int          open_free;
+static spinlock_t   fd_lock;
+
+/* open addressing directory, each slot holds the file index + 1 so 0 means empty. there is no delete,
+so linear probing never needs tombstones */
+static uint16_t dir_slots[DIR_SLOTS];
+
+_Static_assert((DIR_SLOTS & (DIR_SLOTS - 1)) == 0, "DIR_SLOTS must be a power of two");
+_Static_assert(MAX_FILES < 65535, "dir_slots holds fd + 1 in 16 bits");
+
+
+/* this initializes the file subsystem, we need every entry to be consistent and we also need the locks so multiple tasks can't corrupt the FS.*/
 void fs_init(void)
 {
-    spinlock_init(&fs_lock);
-    for (int i = 0; i < MAX_FILES; i++) {
-        files[i].in_use = 0;
-        files[i].owner  = -1;
-        files[i].size   = 0;
+    rwlock_init(&dir_lock);
+    spinlock_init(&fd_lock);
+    kmem_cache_init(&file_cache, "file", sizeof(file_t));
+    kmem_cache_init(&block_cache, "fs-block", FS_BLOCK_SIZE);
+    for (int i = 0; i < MAX_FILES; i++)
+        files[i] = 0;
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        open_files[i].file = 0;
+        open_files[i].next_free = i + 1 < MAX_OPEN_FILES ? i + 1 : -1;
     }
+    open_free = 0;
+    for (int i = 0; i < DIR_SLOTS; i++)
+        dir_slots[i] = 0;
+    file_count = 0;
 }
 
-/* Find file index by name, or -1 */
-static int fs_find(const char *name)
+/* FNV-1a over the name, also works out its length in the same pass. names are cut at
+MAX_FILE_NAME - 1 the same way fs_create stores them, so a long name finds its file again */
+static uint32_t fs_hash_name(const char *name, uint32_t *len)
 {
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].in_use &&
-            kstrlen(name) == kstrlen(files[i].name)) {
-            const char *a = name;
-            const char *b = files[i].name;
-            size_t j = 0;
-            for (; j < kstrlen(name); j++) {
-                if (a[j] != b[j]) break;
-            }
-            if (j == kstrlen(name))
-                return i;
+    uint32_t h = 2166136261u;
+    uint32_t n = 0;
+    while (name[n] && n < MAX_FILE_NAME - 1) {
+        h = (h ^ (uint8_t)name[n]) * 16777619u;
+        n++;
+    }
+    *len = n;
+    return h;
+}
+
+/* Find file index by name, or -1. the hash and length are checked before any bytes, so
+a miss almost never compares names. dir_lock must be held */
+static int fs_find_hashed(const char *name, uint32_t hash, uint32_t len, uint32_t *slot_out)
+{
+    uint32_t slot = hash & (DIR_SLOTS - 1);
+    while (dir_slots[slot]) {
+        file_t *f = files[dir_slots[slot] - 1];
+        if (f->name_hash == hash && f->name_len == len) {
+            uint32_t j = 0;
+            while (j < len && f->name[j] == name[j])
+                j++;
+            if (j == len)
+                return dir_slots[slot] - 1;
         }
+        slot = (slot + 1) & (DIR_SLOTS - 1);
     }
+    if (slot_out)
+        *slot_out = slot;
     return -1;
 }
 
-/* creates files with name, owner ID, and permissions, this needs the spinlock because without it two tasks could create files in the same slot.*/
-int fs_create(const char *name, int owner, uint32_t perm)
+static int fs_find(const char *name)
 {
-    spinlock_lock(&fs_lock);
-
-    int existing = fs_find(name);
-    if (existing >= 0) {
-        spinlock_unlock(&fs_lock);
-        return existing;
-    }
+    uint32_t len;
+    uint32_t hash = fs_hash_name(name, &len);
+    return fs_find_hashed(name, hash, len, 0);
+}
 
-    /* find free slots in the table*/
-    int idx = -1;
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (!files[i].in_use) {
-            idx = i;
-            break;
-        }
-    }
-    if (idx < 0) {
-        spinlock_unlock(&fs_lock);
-        return -1; /* no space */
+/* takes a descriptor for f with its offset at 0, -1 if they are all in use */
+static int fs_fd_alloc(file_t *f, uint32_t mode)
+{
+    uint32_t irq = spinlock_lock_irqsave(&fd_lock);
+    int fd = open_free;
+    if (fd >= 0) {
+        open_free = open_files[fd].next_free;
+        open_files[fd].offset = 0;
+        open_files[fd].mode   = mode;
+        open_files[fd].file   = f;
     }
+    spinlock_unlock_irqrestore(&fd_lock, irq);
+    return fd;
+}
 
-    /* initialize the files data copy the name and then return file descriptor*/
-    file_t *f = &files[idx];
-    size_t n = kstrlen(name);
-    if (n >= MAX_FILE_NAME)
-        n = MAX_FILE_NAME - 1;
+/* the open descriptor, 0 if fd is out of range or closed */
+static open_file_t *fs_fd(int fd)
+{
+    if (fd < 0 || fd >= MAX_OPEN_FILES || !open_files[fd].file)
+        return 0;
+    return &open_files[fd];
+}
 
+/* adds name to the directory, or finds it if it is already there, *created says which.
+returns 0 when the directory or memory is full. dir_lock must be held for writing */
+static file_t *fs_insert(const char *name, int owner, uint32_t perm, int *created)
+{
+    uint32_t n;
+    uint32_t hash = fs_hash_name(name, &n);
+    uint32_t slot;
+
+    *created = 0;
+    int existing = fs_find_hashed(name, hash, n, &slot);
+    if (existing >= 0)
+        return files[existing];
+
+    if (file_count >= MAX_FILES)
+        return 0; /* no space */
+    file_t *f = (file_t *)kmem_cache_alloc(&file_cache);
+    if (!f)
+        return 0;
+
+    /* initialize the files data copy the name*/
     for (size_t i = 0; i < n; i++)
         f->name[i] = name[i];
     f->name[n] = '\0';
+    f->name_hash = hash;
+    f->name_len  = n;
 
     f->in_use = 1;
     f->owner  = owner;
     f->perm   = perm;
     f->size   = 0;
-
-    spinlock_unlock(&fs_lock);
-    return idx;
+    f->rodata = 0;
+    for (int i = 0; i < FS_DIRECT_BLOCKS; i++)
+        f->direct[i] = 0;
+    f->indirect = 0;
+    rwlock_init(&f->lock);
+    seqlock_init(&f->seq);
+
+    int idx = file_count++;
+    files[idx] = f;
+    dir_slots[slot] = (uint16_t)(idx + 1);
+    *created = 1;
+    return f;
 }
 
 /* Very small permission check */
 static int fs_can_access(file_t *f, int requester, uint32_t needed)
 {
-    if (!f->in_use) return 0;
+    if (!f || !f->in_use) return 0;
     if ((f->perm & needed) == 0) return 0;
     if (f->owner == -1) return 1;      /* public file */
     if (f->owner == requester) return 1;
     return 0;
 }
 
+/* creates files with name, owner ID, and permissions and opens it, this needs the directory write lock because without it two tasks could create files in the same slot.
+creating a name that already exists opens it again with the same checks as fs_open*/
+int fs_create(const char *name, int owner, uint32_t perm)
+{
+    int created;
+    rwlock_write_lock(&dir_lock);
+    file_t *f = fs_insert(name, owner, perm, &created);
+    rwlock_write_unlock(&dir_lock);
+
+    if (!f)
+        return -1;
+    if (created)
+        return fs_fd_alloc(f, f->perm);
 
-/* this locates the file and makes sure the user has read access*/
-int fs_open(const char *name, int requester)
+    if (!fs_can_access(f, owner, 1u))
+        return -1;
+    uint32_t mode = 1u | (fs_can_access(f, owner, 2u) ? 2u : 0u);
+    return fs_fd_alloc(f, mode);
+}
+
+/* adds a public read-only file whose contents are size bytes at data, which must stay there
+for good (the initramfs in the kernel image). nothing is copied and no blocks are allocated.
+returns -1 if the name is taken or the directory is full */
+int fs_create_static(const char *name, const void *data, size_t size)
 {
-    spinlock_lock(&fs_lock);
+    int created;
+    rwlock_write_lock(&dir_lock);
+    file_t *f = fs_insert(name, -1, 1u, &created);
+    if (f && created) {
+        f->rodata = (const uint8_t *)data;
+        f->size   = size;
+    }
+    rwlock_write_unlock(&dir_lock);
+    return f && created ? 0 : -1;
+}
 
+
+/* this locates the file and makes sure the user has read access, the descriptor can also
+write if the requester is allowed to*/
+int fs_open(const char *name, int requester)
+{
+    rwlock_read_lock(&dir_lock);
     int idx = fs_find(name);
-    if (idx < 0) {
-        spinlock_unlock(&fs_lock);
+    file_t *f = idx >= 0 ? files[idx] : 0;
+    rwlock_read_unlock(&dir_lock);
+
+    /* a file is never removed and its owner and perm never change, so no lock is needed from here */
+    if (!f || !fs_can_access(f, requester, 1u))
         return -1;
-    }
 
-    file_t *f = &files[idx];
-    if (!fs_can_access(f, requester, 1u)) {
-        spinlock_unlock(&fs_lock);
+    uint32_t mode = 1u | (fs_can_access(f, requester, 2u) ? 2u : 0u);
+    return fs_fd_alloc(f, mode);
+}
+
+/* gives the descriptor back, the file stays */
+int fs_close(int fd)
+{
+    uint32_t irq = spinlock_lock_irqsave(&fd_lock);
+    open_file_t *of = fs_fd(fd);
+    if (!of) {
+        spinlock_unlock_irqrestore(&fd_lock, irq);
         return -1;
     }
+    of->file = 0;
+    of->next_free = open_free;
+    open_free = fd;
+    spinlock_unlock_irqrestore(&fd_lock, irq);
+    return 0;
+}
+
+/* block n of the file, allocating it (and the indirect block) when alloc is set.
+0 if it doesn't exist yet or we are out of memory. allocating needs the file's write lock,
+looking up doesn't: blocks are never freed and a pointer only ever goes from 0 to a block */
+static uint8_t *fs_block(file_t *f, size_t n, int alloc)
+{
+    /* a static file's blocks are just consecutive pieces of its data, it is never written through
+    this pointer since fs_write_at turns it away */
+    if (f->rodata)
+        return n * FS_BLOCK_SIZE < f->size ? (uint8_t *)(f->rodata + n * FS_BLOCK_SIZE) : 0;
+
+    uint8_t **ptr;
+    if (n < FS_DIRECT_BLOCKS) {
+        ptr = &f->direct[n];
+    } else {
+        n -= FS_DIRECT_BLOCKS;
+        if (n >= FS_PTRS_PER_BLOCK)
+            return 0;
+        if (!f->indirect) {
+            if (!alloc)
+                return 0;
+            uint8_t **ind = (uint8_t **)kmem_cache_alloc(&block_cache);
+            if (!ind)
+                return 0;
+            for (size_t i = 0; i < FS_PTRS_PER_BLOCK; i++)
+                ind[i] = 0;
+            /* lockless readers may follow the pointer as soon as it is stored, so zero first */
+            __sync_synchronize();
+            f->indirect = ind;
+        }
+        ptr = &f->indirect[n];
+    }
+    if (!*ptr && alloc) {
+        uint8_t *blk = (uint8_t *)kmem_cache_alloc(&block_cache);
+        /* a block written past a hole reads back as zeros around the new data */
+        if (blk) {
+            for (size_t i = 0; i < FS_BLOCK_SIZE; i++)
+                blk[i] = 0;
+            __sync_synchronize();
+            *ptr = blk;
+        }
+    }
+    return *ptr;
+}
 
-    spinlock_unlock(&fs_lock);
-    return idx;
+/* copies len bytes in at offset one block at a time, so only the blocks being written are
+touched. returns the bytes written, short at MAX_FILE_SIZE or when memory runs out, 0 for a static file.
+the caller holds the file's write lock and has the seqlock open for writing */
+static size_t fs_write_at(file_t *f, size_t offset, const uint8_t *src, size_t len)
+{
+    size_t done = 0;
+    if (f->rodata)
+        return 0;
+    while (done < len && offset < MAX_FILE_SIZE) {
+        uint8_t *blk = fs_block(f, offset / FS_BLOCK_SIZE, 1);
+        if (!blk)
+            break;
+        size_t in = offset % FS_BLOCK_SIZE;
+        size_t n = FS_BLOCK_SIZE - in;
+        if (n > len - done)
+            n = len - done;
+        for (size_t i = 0; i < n; i++)
+            blk[in + i] = src[done + i];
+        done += n;
+        offset += n;
+    }
+    if (offset > f->size)
+        f->size = offset;
+    return done;
 }
 
 
-/* spinlock is used here when writing files because if two tasks write at the same time corruption happens*/
+/* the file's write lock is used here when writing files because if two tasks write at the same time corruption happens.
+writes at the descriptor's offset and moves it past the data*/
 int fs_write(int fd, const void *buf, size_t len)
 {
-    if (fd < 0 || fd >= MAX_FILES) return -1;
+    open_file_t *of = fs_fd(fd);
+    if (!of || !(of->mode & 2u))
+        return -1;
 
-    spinlock_lock(&fs_lock);
-    file_t *f = &files[fd];
+    file_t *f = of->file;
+    rwlock_write_lock(&f->lock);
+    seqlock_write_begin(&f->seq);
+    size_t n = fs_write_at(f, of->offset, (const uint8_t *)buf, len);
+    seqlock_write_end(&f->seq);
+    rwlock_write_unlock(&f->lock);
 
-    if (!fs_can_access(f, f->owner, 2u)) {
-        spinlock_unlock(&fs_lock);
-        return -1;
-    }
+    of->offset += n;
+    return (int)n;
+}
 
-    if (len > MAX_FILE_SIZE)
-        len = MAX_FILE_SIZE;
+/* writes at the end of the file whatever the offset is, for log style writers.
+costs only the bytes appended, the offset ends up at the new end*/
+int fs_append(int fd, const void *buf, size_t len)
+{
+    open_file_t *of = fs_fd(fd);
+    if (!of || !(of->mode & 2u))
+        return -1;
 
-    const uint8_t *src = (const uint8_t *)buf;
-    for (size_t i = 0; i < len; i++)
-        f->data[i] = src[i];
+    file_t *f = of->file;
+    rwlock_write_lock(&f->lock);
+    seqlock_write_begin(&f->seq);
+    size_t n = fs_write_at(f, f->size, (const uint8_t *)buf, len);
+    of->offset = f->size;
+    seqlock_write_end(&f->seq);
+    rwlock_write_unlock(&f->lock);
 
-    f->size = len;
+    return (int)n;
+}
 
-    spinlock_unlock(&fs_lock);
-    return (int)len;
+/* copies up to len bytes from offset, stopping at the end of the file. runs under the
+file's read lock or inside a seqlock read section, it only reads the file */
+static size_t fs_copy_out(file_t *f, size_t offset, uint8_t *dst, size_t len)
+{
+    size_t size = f->size;
+    if (offset >= size)
+        return 0;
+    if (len > size - offset)
+        len = size - offset;
+
+    size_t done = 0;
+    while (done < len) {
+        size_t off = offset + done;
+        uint8_t *blk = fs_block(f, off / FS_BLOCK_SIZE, 0);
+        size_t in = off % FS_BLOCK_SIZE;
+        size_t n = FS_BLOCK_SIZE - in;
+        if (n > len - done)
+            n = len - done;
+        /* a block that was never written is a hole */
+        for (size_t i = 0; i < n; i++)
+            dst[done + i] = blk ? blk[in + i] : 0;
+        done += n;
+    }
+    return done;
 }
 
-/* reads file data into buffer, locks it so you can't modify file data while reading.*/
+/* reads file data into buffer from the descriptor's offset. reads of up to FS_LOCKLESS_READ
+bytes take no lock at all: they copy and then check the file's seqlock, and copy again if a
+writer got in. bigger reads, or one that keeps losing to writers, take the file's read lock,
+which other readers share.*/
 int fs_read(int fd, void *buf, size_t len)
 {
-    if (fd < 0 || fd >= MAX_FILES) return -1;
-
-    spinlock_lock(&fs_lock);
-    file_t *f = &files[fd];
-
-    if (!fs_can_access(f, -1, 1u)) {
-        spinlock_unlock(&fs_lock);
+    open_file_t *of = fs_fd(fd);
+    if (!of || !(of->mode & 1u))
         return -1;
+
+    file_t *f = of->file;
+    uint8_t *dst = (uint8_t *)buf;
+    size_t done = 0;
+    int copied = 0;
+
+    if (len <= FS_LOCKLESS_READ) {
+        for (int tries = 0; tries < FS_SEQ_RETRIES && !copied; tries++) {
+            uint32_t seq = seqlock_read_begin(&f->seq);
+            if (seq & 1)
+                break;    /* a writer is in the middle of it, wait on the lock instead */
+            done = fs_copy_out(f, of->offset, dst, len);
+            copied = !seqlock_read_retry(&f->seq, seq);
+        }
+    }
+    if (!copied) {
+        rwlock_read_lock(&f->lock);
+        done = fs_copy_out(f, of->offset, dst, len);
+        rwlock_read_unlock(&f->lock);
     }
 
-    if (len > f->size)
-        len = f->size;
+    of->offset += done;
+    return (int)done;
+}
 
-    uint8_t *dst = (uint8_t *)buf;
-    for (size_t i = 0; i < len; i++)
-        dst[i] = f->data[i];
+/* moves the descriptor's offset, it can go past the end of the file (up to MAX_FILE_SIZE, or
+the size of a bigger static file) and a write there leaves a hole. returns the new offset or -1 */
+long fs_seek(int fd, long offset, int whence)
+{
+    open_file_t *of = fs_fd(fd);
+    if (!of)
+        return -1;
 
-    spinlock_unlock(&fs_lock);
-    return (int)len;
+    long base;
+    if (whence == FS_SEEK_SET)
+        base = 0;
+    else if (whence == FS_SEEK_CUR)
+        base = (long)of->offset;
+    else if (whence == FS_SEEK_END)
+        base = (long)of->file->size;
+    else
+        base = -1;
+
+    long pos = base + offset;
+    if (base < 0 || pos < 0 || (pos > (long)MAX_FILE_SIZE && pos > (long)of->file->size))
+        return -1;
+    of->offset = (size_t)pos;
+    return pos;
 }
 
 
-/* prints existing files to the UART console, helps with debugging and seeing the FS state. kind of like "ls" in linux terminals.*/
+/* what fs_list prints for one file */
+typedef struct {
+    char     name[MAX_FILE_NAME];
+    uint32_t size;
+    int      owner;
+    uint32_t perm;
+} fs_list_entry_t;
+
+/* prints existing files to the UART console, helps with debugging and seeing the FS state. kind of like "ls" in linux terminals.
+the directory is copied under the read lock and printed after it is dropped, so a slow console never holds up the FS*/
 void fs_list(void)
 {
-    spinlock_lock(&fs_lock);
+    rwlock_read_lock(&dir_lock);
+    int count = file_count;
+    fs_list_entry_t *snap = count ? (fs_list_entry_t *)kmalloc(sizeof(fs_list_entry_t) * count) : 0;
+    if (count && !snap) {
+        rwlock_read_unlock(&dir_lock);
+        uart_puts("fs_list: out of memory\n");
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        file_t *f = files[i];
+        for (int j = 0; j < MAX_FILE_NAME; j++)
+            snap[i].name[j] = f->name[j];
+        snap[i].size  = (uint32_t)f->size;
+        snap[i].owner = f->owner;
+        snap[i].perm  = f->perm;
+    }
+    rwlock_read_unlock(&dir_lock);
 
     uart_puts("Files:\n");
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (files[i].in_use) {
-            uart_printf("  %s (size=%d, owner=%d, perm=0x%x)\n",
-                        files[i].name, (int)files[i].size,
-                        files[i].owner, files[i].perm);
-        }
+    for (int i = 0; i < count; i++) {
+        uart_printf("  %s (size=%d, owner=%d, perm=0x%x)\n",
+                    snap[i].name, (int)snap[i].size,
+                    snap[i].owner, snap[i].perm);
     }
-
-    spinlock_unlock(&fs_lock);
+    kfree(snap);
 }
@@ -3,24 +3,64 @@
 #include <stdint.h>
 
 #include "sync.h"
+#include "wait.h"
 
-#define MAX_FILES      8
+#define MAX_FILES      4096
 #define MAX_FILE_NAME  16
-#define MAX_FILE_SIZE  256
+
+/* directory hash table slots, a power of two and at least twice MAX_FILES so probe chains stay short */
+#define DIR_SLOTS      (2 * MAX_FILES)
+
+/* File data lives in FS_BLOCK_SIZE blocks allocated as they are first written. The first
+FS_DIRECT_BLOCKS are pointed to from file_t, the rest from one indirect block of pointers. */
+#define FS_BLOCK_SIZE      512
+#define FS_DIRECT_BLOCKS   12
+#define FS_PTRS_PER_BLOCK  (FS_BLOCK_SIZE / sizeof(uint8_t *))
+#define MAX_FILE_SIZE      ((FS_DIRECT_BLOCKS + FS_PTRS_PER_BLOCK) * FS_BLOCK_SIZE)
+
+/* open file descriptors, shared by all tasks */
+#define MAX_OPEN_FILES     256
+
+/* reads up to this many bytes try the lockless seqlock path first, this many times */
+#define FS_LOCKLESS_READ   FS_BLOCK_SIZE
+#define FS_SEQ_RETRIES     4
+
+/* fs_seek whence */
+#define FS_SEEK_SET  0
+#define FS_SEEK_CUR  1
+#define FS_SEEK_END  2
 
 /* perm bits: 1 = read, 2 = write */
 typedef struct {
     char name[MAX_FILE_NAME];
-    uint8_t data[MAX_FILE_SIZE];
+    uint32_t name_hash;  /* FNV-1a of the name, checked before the bytes are compared */
+    uint32_t name_len;
+    uint8_t *direct[FS_DIRECT_BLOCKS];
+    uint8_t **indirect;  /* 0 until the file grows past the direct blocks */
+    const uint8_t *rodata; /* static files only: the contents, in place in the kernel image */
     size_t size;
     int in_use;
     int owner;       /* task id that owns this file, or -1 for public */
     uint32_t perm;   /* bitmask */
+    rwlock_t lock;   /* writers take it for writing, big reads for reading */
+    seqlock_t seq;   /* bumped around every write, for lockless small reads */
 } file_t;
 
+/* an open file, every fs_open/fs_create gets its own offset */
+typedef struct {
+    file_t  *file;
+    size_t   offset;
+    uint32_t mode;   /* perm bits this descriptor may use */
+    int      next_free;
+} open_file_t;
+
 void fs_init(void);
 int  fs_create(const char *name, int owner, uint32_t perm);
+int  fs_create_static(const char *name, const void *data, size_t size);
 int  fs_open(const char *name, int requester);
+int  fs_close(int fd);
 int  fs_write(int fd, const void *buf, size_t len);
+int  fs_append(int fd, const void *buf, size_t len);
 int  fs_read(int fd, void *buf, size_t len);
+long fs_seek(int fd, long offset, int whence);
 void fs_list(void);
@@ -0,0 +1,83 @@
+/* kernel/initramfs.c */
+#include "initramfs.h"
+#include "common.h"
+#include "fs.h"
+#include "uart.h"
+
+/* a newc header is "070701" and then 13 fields of 8 hex digits, the name follows it and the
+data follows the name, each padded out to 4 bytes from the start of the archive */
+#define CPIO_HEADER_SIZE  110
+#define CPIO_MODE_TYPE    0170000u
+#define CPIO_MODE_FILE    0100000u
+
+/* field i of the header, -1 as unsigned if it isn't hex */
+static uint32_t cpio_field(const uint8_t *hdr, int i)
+{
+    const uint8_t *p = hdr + 6 + 8 * i;
+    uint32_t v = 0;
+    for (int j = 0; j < 8; j++) {
+        uint8_t c = p[j];
+        uint32_t d;
+        if (c >= '0' && c <= '9')
+            d = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            d = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            d = c - 'A' + 10;
+        else
+            return 0xffffffffu;
+        v = (v << 4) | d;
+    }
+    return v;
+}
+
+static uint32_t cpio_align(uint32_t off)
+{
+    return (off + 3u) & ~3u;
+}
+
+/* walks the archive and adds every regular file to the filesystem as a static file, its
+data stays where it is in the image. directories and the rest are skipped, a leading "./"
+is dropped from names. returns the number of files added, or -1 if the archive is bad */
+int initramfs_load(const uint8_t *start, const uint8_t *end)
+{
+    uint32_t size = (uint32_t)(end - start);
+    uint32_t off = 0;
+    int added = 0;
+
+    while (off + CPIO_HEADER_SIZE <= size) {
+        const uint8_t *hdr = start + off;
+        if (hdr[0] != '0' || hdr[1] != '7' || hdr[2] != '0' || hdr[3] != '7' ||
+            hdr[4] != '0' || hdr[5] != '1') {
+            uart_printf("initramfs: bad header at offset %d\n", (int)off);
+            return -1;
+        }
+        uint32_t mode     = cpio_field(hdr, 1);
+        uint32_t filesize = cpio_field(hdr, 6);
+        uint32_t namesize = cpio_field(hdr, 11);
+        uint32_t name_off = off + CPIO_HEADER_SIZE;
+        uint32_t data_off = cpio_align(name_off + namesize);
+        if (mode == 0xffffffffu || namesize == 0 || namesize > size - name_off ||
+            data_off > size || filesize > size - data_off || start[name_off + namesize - 1] != '\0') {
+            uart_printf("initramfs: truncated entry at offset %d\n", (int)off);
+            return -1;
+        }
+
+        const char *name = (const char *)start + name_off;
+        if (kstreq(name, "TRAILER!!!"))
+            break;
+        if (name[0] == '.' && name[1] == '/')
+            name += 2;
+
+        if ((mode & CPIO_MODE_TYPE) == CPIO_MODE_FILE && name[0]) {
+            if (kstrlen(name) >= MAX_FILE_NAME)
+                uart_printf("initramfs: %s: name is longer than %d characters\n", name, MAX_FILE_NAME - 1);
+            else if (fs_create_static(name, start + data_off, filesize) < 0)
+                uart_printf("initramfs: %s: could not add it\n", name);
+            else
+                added++;
+        }
+        off = cpio_align(data_off + filesize);
+    }
+    return added;
+}
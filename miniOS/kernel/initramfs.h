@@ -0,0 +1,9 @@
+#pragma once
+#include <stdint.h>
+
+/* the newc cpio archive linked into the kernel by kernel/initramfs_image.S, built from the
+initramfs/ directory by tools/build_initramfs.sh */
+extern const uint8_t _initramfs_start[];
+extern const uint8_t _initramfs_end[];
+
+int initramfs_load(const uint8_t *start, const uint8_t *end);
@@ -0,0 +1,66 @@
+#include "irq.h"
+#include "plic.h"
+#include "riscv.h"
+#include "smp.h"
+#include "timer.h"
+#include "uart.h"
+
+_Static_assert(sizeof(trap_frame_t) == 144, "trap_frame_t must match TRAP_FRAME_SIZE in trap.S");
+
+/* points this hart's mtvec at trap_vector and lets other harts wake it with a software interrupt,
+interrupts stay off until timer_init turns them on */
+void trap_init(void)
+{
+    csr_write(mtvec, (uint32_t)trap_vector);
+    csr_set(mie, MIE_MSIE);
+}
+
+/* claims device interrupts from the PLIC until none are pending */
+static void external_interrupt(void)
+{
+    uint32_t irq;
+    while ((irq = plic_claim()) != 0) {
+        switch (irq) {
+        case PLIC_IRQ_UART0:
+            uart_interrupt();
+            break;
+        default:
+            uart_printf("trap: unexpected device interrupt %d\n", (int)irq);
+            break;
+        }
+        plic_complete(irq);
+    }
+}
+
+/* called from trap_vector with interrupts off. interrupts are dispatched by cause,
+an exception is a kernel bug since there is no user mode, so it prints where it happened and halts*/
+void trap_handler(trap_frame_t *tf)
+{
+    uint32_t cause = csr_read(mcause);
+
+    if (cause & MCAUSE_INTERRUPT) {
+        switch (cause & ~MCAUSE_INTERRUPT) {
+        case IRQ_M_TIMER:
+            timer_interrupt();
+            break;
+        case IRQ_M_SOFT:
+            smp_ipi();
+            break;
+        case IRQ_M_EXTERNAL:
+            external_interrupt();
+            break;
+        default:
+            uart_printf("trap: unexpected interrupt %d\n", (int)(cause & ~MCAUSE_INTERRUPT));
+            break;
+        }
+        return;
+    }
+
+    /* nothing will run the UART interrupt again, print what is buffered and then the rest directly */
+    uart_panic();
+    uart_printf("trap: exception mcause=%x mepc=%x mtval=%x\n",
+                cause, tf->mepc, csr_read(mtval));
+    for (;;) {
+        __asm__ volatile ("wfi");
+    }
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+/* registers saved by trap_vector in trap.S, the order must match the offsets there */
+typedef struct trap_frame {
+    uint32_t regs[31];   /* x1..x31, regs[i - 1] is xi */
+    uint32_t mepc;
+    uint32_t mstatus;
+    uint32_t pad[3];
+} trap_frame_t;
+
+void trap_init(void);
+void trap_handler(trap_frame_t *tf);
+
+/* Implemented in assembly */
+void trap_vector(void);
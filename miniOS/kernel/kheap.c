@@ -0,0 +1,422 @@
+/* kernel/kheap.c */
+#include "kheap.h"
+#include "sync.h"
+#include "uart.h"
+
+/* one entry per page. only the first page of a block is kept up to date, a free block's
+head says FREE and its order, an allocated one says USED or SLAB */
+enum {
+    PAGE_NONE = 0,    /* inside a block, look at the block's first page */
+    PAGE_FREE,
+    PAGE_USED,
+    PAGE_SLAB
+};
+
+typedef struct page_meta {
+    uint8_t state;
+    uint8_t order;
+    slab_t *slab;     /* every page of a slab points at the slab, so kfree can find it */
+} page_meta_t;
+
+/* free blocks are linked through their own first bytes */
+typedef struct free_block {
+    struct free_block *next;
+    struct free_block *prev;
+} free_block_t;
+
+/* sits at the start of each slab, the objects follow it */
+struct slab {
+    slab_t       *next;
+    slab_t       *prev;
+    kmem_cache_t *cache;
+    void         *free;
+    uint32_t      in_use;
+};
+
+#define SLAB_HEADER  ((sizeof(slab_t) + 15u) & ~15u)
+
+/* held with interrupts off, every section is short and a preempted holder would stall every allocation */
+static spinlock_t    heap_lock;
+static uint8_t      *heap_base;         /* first page the buddy allocator hands out */
+static uint32_t      heap_pages;
+static page_meta_t  *page_meta;         /* lives in the first pages of the region */
+static free_block_t *free_lists[BUDDY_ORDERS];
+static uint32_t      free_pages;
+static uint32_t      large_pages;
+
+static kmem_cache_t  kmalloc_caches[KMALLOC_CLASSES];
+
+
+static uint32_t page_index(const void *p)
+{
+    return (uint32_t)(((uintptr_t)p - (uintptr_t)heap_base) >> PAGE_SHIFT);
+}
+
+static void *page_addr(uint32_t idx)
+{
+    return heap_base + ((uintptr_t)idx << PAGE_SHIFT);
+}
+
+static void free_list_push(uint32_t idx, uint32_t order)
+{
+    free_block_t *b = (free_block_t *)page_addr(idx);
+    b->prev = 0;
+    b->next = free_lists[order];
+    if (b->next)
+        b->next->prev = b;
+    free_lists[order] = b;
+    page_meta[idx].state = PAGE_FREE;
+    page_meta[idx].order = (uint8_t)order;
+}
+
+static void free_list_remove(uint32_t idx, uint32_t order)
+{
+    free_block_t *b = (free_block_t *)page_addr(idx);
+    if (b->prev)
+        b->prev->next = b->next;
+    else
+        free_lists[order] = b->next;
+    if (b->next)
+        b->next->prev = b->prev;
+    page_meta[idx].state = PAGE_NONE;
+}
+
+/* takes a block of 2^order pages, splitting a bigger one if needed. heap_lock must be held */
+static void *buddy_alloc(uint32_t order)
+{
+    uint32_t o = order;
+    while (o < BUDDY_ORDERS && !free_lists[o])
+        o++;
+    if (o >= BUDDY_ORDERS)
+        return 0;
+
+    uint32_t idx = page_index(free_lists[o]);
+    free_list_remove(idx, o);
+    /* hand the upper halves back until the block is the right size */
+    while (o > order) {
+        o--;
+        free_list_push(idx + (1u << o), o);
+    }
+    page_meta[idx].state = PAGE_USED;
+    page_meta[idx].order = (uint8_t)order;
+    free_pages -= 1u << order;
+    return page_addr(idx);
+}
+
+/* gives a block back and merges it with its buddy for as long as the buddy is free too.
+blocks are aligned to their size relative to heap_base, so the buddy is idx ^ 2^order. heap_lock must be held */
+static void buddy_free(void *p, uint32_t order)
+{
+    uint32_t idx = page_index(p);
+    page_meta[idx].state = PAGE_NONE;
+    free_pages += 1u << order;
+
+    while (order + 1 < BUDDY_ORDERS) {
+        uint32_t buddy = idx ^ (1u << order);
+        if (buddy + (1u << order) > heap_pages ||
+            page_meta[buddy].state != PAGE_FREE || page_meta[buddy].order != order)
+            break;
+        free_list_remove(buddy, order);
+        if (buddy < idx)
+            idx = buddy;
+        order++;
+    }
+    free_list_push(idx, order);
+}
+
+/* sets up the page metadata at the start of [start, end) and puts the rest on the free lists
+as the biggest aligned blocks that fit */
+void kheap_init(void *start, void *end)
+{
+    spinlock_init(&heap_lock);
+    for (int o = 0; o < BUDDY_ORDERS; o++)
+        free_lists[o] = 0;
+    free_pages = 0;
+    large_pages = 0;
+
+    uintptr_t lo = ((uintptr_t)start + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+    uintptr_t hi = (uintptr_t)end & ~(uintptr_t)(PAGE_SIZE - 1);
+    uint32_t total = hi > lo ? (uint32_t)((hi - lo) >> PAGE_SHIFT) : 0;
+    uint32_t meta_pages = (uint32_t)((total * sizeof(page_meta_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (meta_pages >= total)
+        total = meta_pages = 0;
+
+    page_meta  = (page_meta_t *)lo;
+    heap_base  = (uint8_t *)lo + ((uintptr_t)meta_pages << PAGE_SHIFT);
+    heap_pages = total - meta_pages;
+    for (uint32_t i = 0; i < heap_pages; i++) {
+        page_meta[i].state = PAGE_NONE;
+        page_meta[i].order = 0;
+        page_meta[i].slab  = 0;
+    }
+
+    uint32_t idx = 0;
+    while (idx < heap_pages) {
+        uint32_t order = BUDDY_ORDERS - 1;
+        while ((idx & ((1u << order) - 1)) || idx + (1u << order) > heap_pages)
+            order--;
+        free_list_push(idx, order);
+        free_pages += 1u << order;
+        idx += 1u << order;
+    }
+
+    for (int c = 0; c < KMALLOC_CLASSES; c++) {
+        static const char *names[KMALLOC_CLASSES] = {
+            "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+            "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+        };
+        kmem_cache_init(&kmalloc_caches[c], names[c], KMALLOC_MIN << c);
+    }
+}
+
+void *page_alloc(uint32_t order)
+{
+    if (order >= BUDDY_ORDERS)
+        return 0;
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    void *p = buddy_alloc(order);
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+    return p;
+}
+
+void page_free(void *p, uint32_t order)
+{
+    if (!p)
+        return;
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    buddy_free(p, order);
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+}
+
+
+static void slab_list_push(slab_t **head, slab_t *s)
+{
+    s->prev = 0;
+    s->next = *head;
+    if (s->next)
+        s->next->prev = s;
+    *head = s;
+}
+
+static void slab_list_remove(slab_t **head, slab_t *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *head = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = 0;
+}
+
+/* objects are rounded up to a pointer so a free one can hold the free list link. slabs grow
+until they hold 8 objects or are 8 pages, which keeps the header and tail waste small*/
+void kmem_cache_init(kmem_cache_t *c, const char *name, uint32_t obj_size)
+{
+    uint32_t i = 0;
+    for (; name[i] && i < KMEM_CACHE_NAME - 1; i++)
+        c->name[i] = name[i];
+    c->name[i] = '\0';
+
+    if (obj_size < sizeof(void *))
+        obj_size = sizeof(void *);
+    obj_size = (obj_size + sizeof(void *) - 1) & ~(uint32_t)(sizeof(void *) - 1);
+    c->obj_size = obj_size;
+    c->order = 0;
+    while (c->order < 3 && ((PAGE_SIZE << c->order) - SLAB_HEADER) / obj_size < 8)
+        c->order++;
+    c->objs_per_slab = ((PAGE_SIZE << c->order) - SLAB_HEADER) / obj_size;
+    c->partial = c->full = c->empty = 0;
+    c->slabs = 0;
+    c->objs_in_use = 0;
+}
+
+/* a new slab with every object on its free list, heap_lock must be held */
+static slab_t *slab_create(kmem_cache_t *c)
+{
+    uint8_t *mem = (uint8_t *)buddy_alloc(c->order);
+    if (!mem)
+        return 0;
+    uint32_t idx = page_index(mem);
+    page_meta[idx].state = PAGE_SLAB;
+    for (uint32_t i = 0; i < (1u << c->order); i++)
+        page_meta[idx + i].slab = (slab_t *)mem;
+
+    slab_t *s = (slab_t *)mem;
+    s->next = s->prev = 0;
+    s->cache = c;
+    s->in_use = 0;
+    s->free = 0;
+    uint8_t *obj = mem + SLAB_HEADER + (c->objs_per_slab - 1) * c->obj_size;
+    for (uint32_t i = 0; i < c->objs_per_slab; i++, obj -= c->obj_size) {
+        *(void **)obj = s->free;
+        s->free = obj;
+    }
+    c->slabs++;
+    return s;
+}
+
+static void slab_destroy(kmem_cache_t *c, slab_t *s)
+{
+    uint32_t idx = page_index(s);
+    for (uint32_t i = 0; i < (1u << c->order); i++)
+        page_meta[idx + i].slab = 0;
+    buddy_free(s, c->order);
+    c->slabs--;
+}
+
+/* O(1): the first partial slab, then the spare empty one, and only then a new slab */
+void *kmem_cache_alloc(kmem_cache_t *c)
+{
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    slab_t *s = c->partial;
+    if (!s) {
+        s = c->empty;
+        if (s)
+            c->empty = 0;
+        else
+            s = slab_create(c);
+        if (!s) {
+            spinlock_unlock_irqrestore(&heap_lock, irq);
+            return 0;
+        }
+        slab_list_push(&c->partial, s);
+    }
+
+    void *obj = s->free;
+    s->free = *(void **)obj;
+    s->in_use++;
+    c->objs_in_use++;
+    if (s->in_use == c->objs_per_slab) {
+        slab_list_remove(&c->partial, s);
+        slab_list_push(&c->full, s);
+    }
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+    return obj;
+}
+
+/* O(1): the page metadata gives the slab, one empty slab is kept so alloc/free at a
+slab boundary doesn't bounce pages through the buddy allocator */
+void kmem_cache_free(kmem_cache_t *c, void *obj)
+{
+    if (!obj)
+        return;
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    slab_t *s = page_meta[page_index(obj)].slab;
+    if (s->in_use == c->objs_per_slab) {
+        slab_list_remove(&c->full, s);
+        slab_list_push(&c->partial, s);
+    }
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->in_use--;
+    c->objs_in_use--;
+    if (s->in_use == 0) {
+        slab_list_remove(&c->partial, s);
+        if (!c->empty)
+            c->empty = s;
+        else
+            slab_destroy(c, s);
+    }
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+}
+
+/* smallest order with 2^order pages >= size */
+static uint32_t pages_order(size_t size)
+{
+    uint32_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < size)
+        order++;
+    return order;
+}
+
+/* small sizes go to the power of two slab cache that fits, the rest get whole pages */
+void *kmalloc(size_t size)
+{
+    if (size == 0)
+        return 0;
+    if (size <= KMALLOC_MAX) {
+        int c = 0;
+        while ((KMALLOC_MIN << c) < size)
+            c++;
+        return kmem_cache_alloc(&kmalloc_caches[c]);
+    }
+
+    uint32_t order = pages_order(size);
+    if (order >= BUDDY_ORDERS)
+        return 0;
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    void *p = buddy_alloc(order);
+    if (p)
+        large_pages += 1u << order;
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+    return p;
+}
+
+/* the page metadata says whether p is a slab object or a block of pages and how big */
+void kfree(void *p)
+{
+    if (!p)
+        return;
+    page_meta_t *m = &page_meta[page_index(p)];
+    if (m->slab) {
+        kmem_cache_free(m->slab->cache, p);
+        return;
+    }
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    large_pages -= 1u << m->order;
+    buddy_free(p, m->order);
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+}
+
+void kheap_get_stats(kheap_stats_t *out)
+{
+    uint32_t irq = spinlock_lock_irqsave(&heap_lock);
+    out->total_pages = heap_pages;
+    out->free_pages  = free_pages;
+    out->largest_free_order = (uint32_t)-1;
+    for (uint32_t o = 0; o < BUDDY_ORDERS; o++) {
+        uint32_t n = 0;
+        for (free_block_t *b = free_lists[o]; b; b = b->next)
+            n++;
+        out->free_blocks[o] = n;
+        if (n)
+            out->largest_free_order = o;
+    }
+    uint32_t small_pages = 0;
+    for (uint32_t o = 0; o < KHEAP_FRAG_ORDER; o++)
+        small_pages += out->free_blocks[o] << o;
+    /* 32-bit math on purpose, a 64-bit divide would need __udivdi3 from libgcc which we don't link.
+    small_pages is at most the page count so the multiply can't overflow */
+    out->fragmentation_pct = free_pages ? small_pages * 100u / free_pages : 0;
+
+    out->slab_pages = 0;
+    out->slab_used_bytes = 0;
+    for (int c = 0; c < KMALLOC_CLASSES; c++) {
+        out->slab_pages += kmalloc_caches[c].slabs << kmalloc_caches[c].order;
+        out->slab_used_bytes += kmalloc_caches[c].objs_in_use * kmalloc_caches[c].obj_size;
+    }
+    out->large_pages = large_pages;
+    spinlock_unlock_irqrestore(&heap_lock, irq);
+}
+
+/* prints the heap state to the UART, like fs_list but for memory */
+void kheap_dump(void)
+{
+    kheap_stats_t st;
+    kheap_get_stats(&st);
+
+    uart_printf("Heap: %d of %d pages free, fragmentation %d%%\n",
+                (int)st.free_pages, (int)st.total_pages, (int)st.fragmentation_pct);
+    uart_puts("  free blocks by order:");
+    for (int o = 0; o < BUDDY_ORDERS; o++)
+        uart_printf(" %d", (int)st.free_blocks[o]);
+    uart_puts("\n");
+    uart_printf("  slabs: %d pages, %d bytes in use; large allocations: %d pages\n",
+                (int)st.slab_pages, (int)st.slab_used_bytes, (int)st.large_pages);
+    for (int c = 0; c < KMALLOC_CLASSES; c++) {
+        kmem_cache_t *k = &kmalloc_caches[c];
+        if (k->slabs)
+            uart_printf("  %s: %d objects in %d slabs\n", k->name, (int)k->objs_in_use, (int)k->slabs);
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Kernel heap. Pages come from a buddy allocator over the RAM between the end of .bss
+and the boot stack, small objects come from slab caches carved out of those pages.
+kheap.c only needs sync.c and uart_printf, so it also builds on the host (make kheap_bench). */
+
+#define PAGE_SIZE        4096u
+#define PAGE_SHIFT       12
+/* biggest buddy block is 2^(BUDDY_ORDERS - 1) pages, 64 MB */
+#define BUDDY_ORDERS     15
+/* fragmentation is measured against requests of 2^KHEAP_FRAG_ORDER pages, 64 KB */
+#define KHEAP_FRAG_ORDER 4
+/* room left for the harts' boot stacks under _stack_top, at least MAX_HARTS * HART_STACK_SIZE */
+#define KHEAP_BOOT_STACK (64u * 1024u)
+
+/* kmalloc size classes are powers of two from KMALLOC_MIN to KMALLOC_MAX, bigger requests get whole pages */
+#define KMALLOC_MIN      16u
+#define KMALLOC_MAX      2048u
+#define KMALLOC_CLASSES  8
+
+#define KMEM_CACHE_NAME  16
+
+typedef struct slab slab_t;
+
+/* a cache of equal sized objects, each slab is 2^order pages with a header at the start */
+typedef struct kmem_cache {
+    char     name[KMEM_CACHE_NAME];
+    uint32_t obj_size;
+    uint32_t order;
+    uint32_t objs_per_slab;
+    slab_t  *partial;     /* slabs with free and used objects */
+    slab_t  *full;
+    slab_t  *empty;       /* at most one is kept, the rest go back to the buddy allocator */
+    uint32_t slabs;
+    uint32_t objs_in_use;
+} kmem_cache_t;
+
+typedef struct kheap_stats {
+    uint32_t total_pages;
+    uint32_t free_pages;
+    uint32_t free_blocks[BUDDY_ORDERS];   /* free buddy blocks of each order */
+    uint32_t largest_free_order;          /* -1 as unsigned when nothing is free */
+    /* percent of free memory in blocks smaller than 2^KHEAP_FRAG_ORDER pages, so it can't
+    serve a request that big. 0 means all free memory is in big blocks */
+    uint32_t fragmentation_pct;
+    uint32_t slab_pages;                  /* pages held by the kmalloc slab caches */
+    uint32_t slab_used_bytes;             /* bytes of those pages in handed out objects */
+    uint32_t large_pages;                 /* pages used by kmalloc calls above KMALLOC_MAX */
+} kheap_stats_t;
+
+void  kheap_init(void *start, void *end);
+
+/* 2^order contiguous pages, give them back with page_free and the same order */
+void *page_alloc(uint32_t order);
+void  page_free(void *p, uint32_t order);
+
+void  kmem_cache_init(kmem_cache_t *c, const char *name, uint32_t obj_size);
+void *kmem_cache_alloc(kmem_cache_t *c);
+void  kmem_cache_free(kmem_cache_t *c, void *obj);
+
+void *kmalloc(size_t size);
+void  kfree(void *p);
+
+void  kheap_get_stats(kheap_stats_t *out);
+void  kheap_dump(void);
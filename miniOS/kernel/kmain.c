@@ -3,10 +3,24 @@
 #include "fs.h"
 #include "sched.h"
 #include "common.h"
+#include "irq.h"
+#include "kheap.h"
+#include "initramfs.h"
+#include "plic.h"
+#include "smp.h"
+#include "timer.h"
+
+/* from linker.ld, the heap is the RAM between the end of .bss and the boot stack */
+extern uint8_t __bss_end[];
+extern uint8_t _stack_top[];
+
+_Static_assert(MAX_HARTS * HART_STACK_SIZE <= KHEAP_BOOT_STACK,
+               "the heap must leave room for every hart's boot stack");
 
 /* User task entry points */
 void user_hello(void);
 void user_counter(void);
+void user_spinner(void);
 
 
 /* after the boot code this function sets up kernel subsystems, creates files and tasks and starts the scheduler, when everything is finished it comes back here*/
@@ -15,24 +29,46 @@ void kmain(void)
     uart_init();
     uart_puts("\n\nminiOS (RISC-V 32) booting...\n");
 
+    trap_init();
+    /* console output is buffered and sent by the UART interrupt from here on */
+    plic_init();
+    uart_irq_init();
+    kheap_init(__bss_end, _stack_top - KHEAP_BOOT_STACK);
     fs_init();
+    /* the files shipped in the image are read where they are, nothing is copied */
+    int shipped = initramfs_load(_initramfs_start, _initramfs_end);
+    if (shipped >= 0)
+        uart_printf("initramfs: %d files\n", shipped);
     scheduler_init();
 
     
     int fd = fs_create("greeting.txt", -1, 1u | 2u);
     const char *msg = "Hello from miniOS kernel!\n";
     fs_write(fd, msg, kstrlen(msg));
+    fs_close(fd);
 
     fs_list();
 
     
     task_create(user_hello);
     task_create(user_counter);
+    task_create(user_spinner);
+
+    /* timer interrupts preempt a task once its time slice is up */
+    timer_init(TIME_SLICE_MS);
+    uart_printf("Time slice: %d ms\n", TIME_SLICE_MS);
+
+    /* the other harts come online and steal tasks from hart 0's queues */
+    smp_start();
 
     uart_puts("Starting scheduler...\n");
     scheduler_start();
 
     uart_puts("All tasks finished, back in kernel. Halting.\n");
+    /* the other harts stay in their idle loops */
+    fs_list();
+    sched_stats();
+    kheap_dump();
 
     for (;;) {
         __asm__ volatile ("wfi");
@@ -0,0 +1,45 @@
+/* kernel/plic.c */
+#include "plic.h"
+#include "riscv.h"
+
+#define PLIC_PRIORITY(irq)   (PLIC_BASE + 4u * (irq))
+#define PLIC_ENABLE(ctx)     (PLIC_BASE + 0x2000u + 0x80u * (ctx))
+#define PLIC_THRESHOLD(ctx)  (PLIC_BASE + 0x200000u + 0x1000u * (ctx))
+#define PLIC_CLAIM(ctx)      (PLIC_THRESHOLD(ctx) + 4u)
+
+static inline volatile uint32_t *plic_reg(uint32_t addr)
+{
+    return (volatile uint32_t *)addr;
+}
+
+/* hart h's M-mode context is 2h, the odd ones are its S-mode */
+static uint32_t plic_context(void)
+{
+    return 2u * csr_read(mhartid);
+}
+
+/* lets every interrupt with a priority above 0 through to this hart and turns on
+external interrupts in mie, nothing is delivered until a source is enabled too */
+void plic_init(void)
+{
+    *plic_reg(PLIC_THRESHOLD(plic_context())) = 0;
+    csr_set(mie, MIE_MEIE);
+}
+
+void plic_enable(uint32_t irq)
+{
+    *plic_reg(PLIC_PRIORITY(irq)) = 1;
+    *plic_reg(PLIC_ENABLE(plic_context()) + 4u * (irq / 32u)) |= 1u << (irq % 32u);
+}
+
+/* the highest priority pending interrupt, 0 if there are none left. the source stays
+masked until plic_complete, so a level triggered device can't fire again mid handler */
+uint32_t plic_claim(void)
+{
+    return *plic_reg(PLIC_CLAIM(plic_context()));
+}
+
+void plic_complete(uint32_t irq)
+{
+    *plic_reg(PLIC_CLAIM(plic_context())) = irq;
+}
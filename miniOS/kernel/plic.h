@@ -0,0 +1,12 @@
+#pragma once
+#include <stdint.h>
+
+/* the PLIC on QEMU virt routes device interrupts to the harts, each hart's M-mode is a
+context with its own enable bits, priority threshold and claim register */
+#define PLIC_BASE        0x0c000000u
+#define PLIC_IRQ_UART0   10
+
+void     plic_init(void);
+void     plic_enable(uint32_t irq);
+uint32_t plic_claim(void);
+void     plic_complete(uint32_t irq);
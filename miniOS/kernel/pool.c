@@ -0,0 +1,47 @@
+#include "pool.h"
+
+/* threads every object onto the free list, obj_size has to hold a pointer */
+void pool_init(pool_t *p, void *mem, size_t obj_size, size_t count)
+{
+    p->base      = (uint8_t *)mem;
+    p->obj_size  = obj_size;
+    p->count     = count;
+    p->used      = 0;
+    p->free_list = 0;
+    /* pushed in reverse so objects are handed out from the start of the array */
+    for (size_t i = count; i > 0; i--) {
+        void *obj = p->base + (i - 1) * obj_size;
+        *(void **)obj = p->free_list;
+        p->free_list = obj;
+    }
+}
+
+/* returns 0 when the pool is empty */
+void *pool_alloc(pool_t *p)
+{
+    void *obj = p->free_list;
+    if (!obj)
+        return 0;
+    p->free_list = *(void **)obj;
+    p->used++;
+    return obj;
+}
+
+void pool_free(pool_t *p, void *obj)
+{
+    *(void **)obj = p->free_list;
+    p->free_list = obj;
+    p->used--;
+}
+
+/* position of obj in the pool's array */
+int pool_index(const pool_t *p, const void *obj)
+{
+    return (int)(((const uint8_t *)obj - p->base) / p->obj_size);
+}
+
+int pool_owns(const pool_t *p, const void *obj)
+{
+    const uint8_t *o = (const uint8_t *)obj;
+    return o >= p->base && o < p->base + p->obj_size * p->count;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* fixed size object pool over a caller supplied array. free objects are linked through
+their own first word, so alloc and free are O(1) and there is no per object header */
+typedef struct pool {
+    uint8_t *base;
+    size_t   obj_size;
+    size_t   count;
+    size_t   used;
+    void    *free_list;
+} pool_t;
+
+void   pool_init(pool_t *p, void *mem, size_t obj_size, size_t count);
+void  *pool_alloc(pool_t *p);
+void   pool_free(pool_t *p, void *obj);
+int    pool_index(const pool_t *p, const void *obj);
+int    pool_owns(const pool_t *p, const void *obj);
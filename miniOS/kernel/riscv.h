@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+
+/* machine mode CSR bits we use, everything runs in M-mode on QEMU virt with -bios none */
+#define MSTATUS_MIE   (1u << 3)
+#define MSTATUS_MPIE  (1u << 7)
+
+#define MIE_MSIE      (1u << 3)    /* machine software interrupt enable */
+#define MIE_MTIE      (1u << 7)    /* machine timer interrupt enable */
+#define MIE_MEIE      (1u << 11)   /* machine external interrupt enable */
+
+#define MCAUSE_INTERRUPT  (1u << 31)
+#define IRQ_M_SOFT        3
+#define IRQ_M_TIMER       7
+#define IRQ_M_EXTERNAL    11
+
+/* the CLINT on QEMU virt: per hart software interrupt and timer registers */
+#define CLINT_BASE        0x02000000u
+
+#define csr_read(csr) ({ uint32_t __v; __asm__ volatile ("csrr %0, " #csr : "=r"(__v)); __v; })
+#define csr_write(csr, val) __asm__ volatile ("csrw " #csr ", %0" :: "r"((uint32_t)(val)) : "memory")
+#define csr_set(csr, bits) __asm__ volatile ("csrs " #csr ", %0" :: "r"((uint32_t)(bits)) : "memory")
+#define csr_clear(csr, bits) __asm__ volatile ("csrc " #csr ", %0" :: "r"((uint32_t)(bits)) : "memory")
+
+/* turns interrupts off and returns whether they were on, so nested sections can put back what they found */
+static inline uint32_t intr_save(void)
+{
+    uint32_t old;
+    __asm__ volatile ("csrrci %0, mstatus, 8" : "=r"(old) :: "memory");
+    return old & MSTATUS_MIE;
+}
+
+static inline void intr_restore(uint32_t was_on)
+{
+    if (was_on)
+        csr_set(mstatus, MSTATUS_MIE);
+}
+
+static inline void intr_on(void)
+{
+    csr_set(mstatus, MSTATUS_MIE);
+}
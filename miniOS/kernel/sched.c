@@ -1,48 +1,287 @@
 #include "sched.h"
+#include "kheap.h"
+#include "pool.h"
+#include "riscv.h"
+#include "timer.h"
 #include "uart.h"
 
-static task_t tasks[MAX_TASKS];
-static int    current = -1;
-static context_t kernel_ctx;
+/* TCBs and stacks live in fixed size pools, a task takes one of each when it is created
+and gives them back when it is reaped. pool_lock covers the pools and the task counters */
+static pool_t     task_pool;
+static spinlock_t pool_lock;
 
-static int pick_next_runnable(void);
+_Static_assert(STACK_COUNT_0 + STACK_COUNT_1 + STACK_COUNT_2 + STACK_COUNT_3 == MAX_TASKS,
+               "the stack pools must hold a stack for every task");
+static const int stack_class_count[STACK_CLASSES] = STACK_CLASS_COUNTS;
+static pool_t  stack_pool[STACK_CLASSES];
 
+static uint32_t tasks_reaped;
+/* created and not yet reaped, hart 0 leaves the scheduler when this gets to 0 */
+static volatile uint32_t tasks_live;
 
-/* initialize scheudler structures before any tasks are created, every tasks begins in known state and the schduler doesn't assume previous state memory*/
+/* Each hart has its own ready queues and its own current task, so harts only touch each
+other's state to hand over a task or steal one. a hart that runs out of work switches to its
+idle context, a loop on its boot stack that takes work from the busiest other hart or waits
+for an interrupt. */
+typedef struct hart {
+    uint32_t   id;
+    volatile uint32_t online;
+    task_t    *current;
+    /* the task this hart just switched away from, it is let go once we are off its stack */
+    task_t    *prev;
+    context_t  idle_ctx;
+    /* ready tasks, one FIFO per priority linked through task_t.next. bit p of ready_bitmap is set
+    while queue p is not empty, so finding the best ready task never looks at the other tasks.
+    lock covers all three and nr_ready */
+    spinlock_t lock;
+    task_t    *ready_head[NUM_PRIORITIES];
+    task_t    *ready_tail[NUM_PRIORITIES];
+    uint32_t   ready_bitmap;
+    volatile uint32_t nr_ready;
+    uint32_t   switches;
+    uint32_t   steals;
+} hart_t;
+
+static hart_t   harts[MAX_HARTS];
+static uint32_t next_hart;    /* where task_create puts the next task, round robin */
+
+
+/* the hart we are on. only meaningful with interrupts off, otherwise the task could be preempted
+and carry on on another hart */
+static hart_t *this_hart(void)
+{
+    return &harts[csr_read(mhartid)];
+}
+
+/* initialize scheudler structures before any tasks are created, every tasks begins in known state and the schduler doesn't assume previous state memory.
+runs on hart 0 before the other harts are released*/
 void scheduler_init(void)
 {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        tasks[i].id    = i;
-        tasks[i].state = TASK_UNUSED;
-        tasks[i].entry = 0;
+    spinlock_init(&pool_lock);
+
+    /* the pools' memory comes from the kernel heap, so kheap_init has to run first */
+    task_t *task_mem = (task_t *)kmalloc(sizeof(task_t) * MAX_TASKS);
+    if (!task_mem) {
+        uart_puts("scheduler_init: no memory for task table\n");
+        return;
     }
-    current = -1;
+    pool_init(&task_pool, task_mem, sizeof(task_t), MAX_TASKS);
+
+    for (int c = 0; c < STACK_CLASSES; c++) {
+        uint32_t size = STACK_MIN << c;
+        uint8_t *mem = (uint8_t *)kmalloc((size_t)size * stack_class_count[c]);
+        if (!mem) {
+            uart_printf("scheduler_init: no memory for %d byte stacks\n", (int)size);
+            pool_init(&stack_pool[c], 0, size, 0);
+            continue;
+        }
+        pool_init(&stack_pool[c], mem, size, stack_class_count[c]);
+    }
+
+    for (uint32_t i = 0; i < MAX_HARTS; i++) {
+        hart_t *h = &harts[i];
+        h->id = i;
+        h->online = 0;
+        h->current = 0;
+        h->prev = 0;
+        spinlock_init(&h->lock);
+        for (int p = 0; p < NUM_PRIORITIES; p++) {
+            h->ready_head[p] = 0;
+            h->ready_tail[p] = 0;
+        }
+        h->ready_bitmap = 0;
+        h->nr_ready = 0;
+        h->switches = 0;
+        h->steals = 0;
+    }
+    this_hart()->online = 1;
+    next_hart = 0;
+    tasks_reaped = 0;
+    tasks_live = 0;
+}
+
+/* index of the lowest set bit, x must not be 0. rv32imac has no count trailing zeros
+instruction and we don't link libgcc, so this isolates the bit and looks it up with a de Bruijn multiply*/
+static int lowest_set_bit(uint32_t x)
+{
+    static const uint8_t debruijn_index[32] = {
+        0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+        31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9
+    };
+    return debruijn_index[((x & -x) * 0x077CB531u) >> 27];
+}
+
+/* adds a task to the back of its priority's queue on h, h->lock must be held */
+static void ready_push(hart_t *h, task_t *t)
+{
+    t->next = 0;
+    t->hart = (int)h->id;
+    if (h->ready_tail[t->priority])
+        h->ready_tail[t->priority]->next = t;
+    else
+        h->ready_head[t->priority] = t;
+    h->ready_tail[t->priority] = t;
+    h->ready_bitmap |= 1u << t->priority;
+    h->nr_ready++;
 }
 
-/* Find unused slots for new tasks */
-static int alloc_task(void)
+/* takes the task at the front of queue prio on h, which must not be empty. h->lock must be held */
+static task_t *ready_pop(hart_t *h, int prio)
 {
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_UNUSED)
-            return i;
+    task_t *t = h->ready_head[prio];
+    h->ready_head[prio] = t->next;
+    if (!h->ready_head[prio]) {
+        h->ready_tail[prio] = 0;
+        h->ready_bitmap &= ~(1u << prio);
+    }
+    h->nr_ready--;
+    t->next = 0;
+    return t;
+}
+
+/* best priority with a ready task on h, NUM_PRIORITIES if none are ready */
+static int best_ready_priority(hart_t *h)
+{
+    return h->ready_bitmap ? lowest_set_bit(h->ready_bitmap) : NUM_PRIORITIES;
+}
+
+/* queues t on hart h and wakes h up if it is idle in wfi, interrupts must be off */
+static void make_ready(hart_t *h, task_t *t)
+{
+    t->state = TASK_READY;
+    t->ready_since = timer_now();
+    spinlock_lock(&h->lock);
+    ready_push(h, t);
+    spinlock_unlock(&h->lock);
+    if (h != this_hart() && !h->current)
+        smp_kick(h->id);
+}
+
+/* gives a finished task's TCB and stack back to their pools. a task can't free its own stack
+while it is still running on it, so this happens on the next stack its hart switches to */
+static void reap(task_t *t)
+{
+    spinlock_lock(&pool_lock);
+    pool_free(&stack_pool[t->stack_class], t->stack);
+    t->state = TASK_UNUSED;
+    pool_free(&task_pool, t);
+    tasks_reaped++;
+    tasks_live--;
+    spinlock_unlock(&pool_lock);
+    /* hart 0 may be idle waiting for the last task to go */
+    if (tasks_live == 0 && csr_read(mhartid) != 0)
+        smp_kick(0);
+}
+
+/* the task ran off the bottom of its stack and has written over whatever is below it, most
+likely another task's stack. nothing can be trusted any more, so report it and halt this hart */
+static void stack_overflow(task_t *t)
+{
+    uart_panic();
+    uart_printf("task %d overflowed its %d byte stack\n", t->id, (int)t->stack_size);
+    for (;;) {
+        __asm__ volatile ("wfi");
+    }
+}
+
+/* every context switch on a hart ends here, on the new stack with interrupts off. the task we
+came from can now be run by another hart, or reaped if it finished */
+static void finish_switch(void)
+{
+    hart_t *h = this_hart();
+    task_t *p = h->prev;
+    if (!p)
+        return;
+    h->prev = 0;
+    if (*(uint32_t *)p->stack != STACK_CANARY)
+        stack_overflow(p);
+    if (p->state == TASK_FINISHED) {
+        reap(p);
+        return;
+    }
+    __atomic_store_n(&p->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+/* switches from the task p (0 for the idle context) to n on hart h, interrupts must be off.
+returns once p is switched back in, possibly on another hart */
+static void switch_to(hart_t *h, task_t *p, task_t *n)
+{
+    /* n may still be going to sleep on the hart it ran on last, wait until it is off its stack */
+    while (__atomic_load_n(&n->on_cpu, __ATOMIC_ACQUIRE))
+        __asm__ volatile ("nop");
+    n->on_cpu = 1;
+    n->state = TASK_RUNNING;
+    uint64_t now = timer_now();
+    if (now - n->ready_since > n->max_wait)
+        n->max_wait = now - n->ready_since;
+
+    h->current = n;
+    h->prev = p;
+    h->switches++;
+    context_switch(p ? &p->ctx : &h->idle_ctx, &n->ctx);
+    finish_switch();
+}
+
+/* smallest stack class that fits size and still has a free stack, a full class falls back to
+the next bigger one. returns the class or -1. pool_lock must be held */
+static int alloc_stack(uint32_t size, uint8_t **stack)
+{
+    for (int c = 0; c < STACK_CLASSES; c++) {
+        if (((uint32_t)STACK_MIN << c) < size)
+            continue;
+        *stack = (uint8_t *)pool_alloc(&stack_pool[c]);
+        if (*stack)
+            return c;
     }
     return -1;
 }
 
+/* the next online hart after the last one task_create used */
+static hart_t *pick_hart(void)
+{
+    for (uint32_t i = 0; i < MAX_HARTS; i++) {
+        uint32_t id = __atomic_fetch_add(&next_hart, 1, __ATOMIC_RELAXED) % MAX_HARTS;
+        if (harts[id].online)
+            return &harts[id];
+    }
+    return this_hart();
+}
+
 /* starting point for new tasks, we do this because its better for the scheduler to have a certain place to find new tasks */
 static void task_trampoline(void);
 
 /* creates new tasks, these tasks run entry() when they are scheduled
-allocates free slot, marks the slot as ready, sets up ra and sp which is the address of task_trampoline and the top of the task stack*/
-int task_create(task_entry_t entry)
+allocates a TCB and a stack of at least stack_size bytes, marks the task as ready, sets up ra and sp which is the address of task_trampoline and the top of the task stack.
+priority 0 is the most important, a task only runs when no task with a lower number is ready on its hart.
+new tasks are dealt out to the online harts in turn*/
+int task_create_ex(task_entry_t entry, int priority, uint32_t stack_size)
 {
-    int idx = alloc_task();
-    if (idx < 0)
+    if (priority < 0 || priority >= NUM_PRIORITIES)
         return -1;
 
-    task_t *t = &tasks[idx];
+    uint32_t irq = spinlock_lock_irqsave(&pool_lock);
+    task_t *t = (task_t *)pool_alloc(&task_pool);
+    if (!t) {
+        spinlock_unlock_irqrestore(&pool_lock, irq);
+        return -1;
+    }
+    uint8_t *stack = 0;
+    int stack_class = alloc_stack(stack_size, &stack);
+    if (stack_class < 0) {
+        pool_free(&task_pool, t);
+        spinlock_unlock_irqrestore(&pool_lock, irq);
+        return -1;
+    }
+    tasks_live++;
+    spinlock_unlock(&pool_lock);
+
+    t->id = pool_index(&task_pool, t);
     t->entry = entry;
-    t->state = TASK_READY;
+    t->priority = priority;
+    t->stack = stack;
+    t->stack_size = STACK_MIN << stack_class;
+    t->stack_class = stack_class;
+    t->on_cpu = 0;
 
     /* New task context: separate stack, start at task_trampoline */
     for (int i = 0; i < (int)sizeof(context_t)/4; i++) {
@@ -50,96 +289,291 @@ int task_create(task_entry_t entry)
     }
 
     t->ctx.ra = (uint32_t)task_trampoline;
-    t->ctx.sp = (uint32_t)(t->stack + STACK_SIZE);
+    t->ctx.sp = (uint32_t)(t->stack + t->stack_size);
+    *(uint32_t *)t->stack = STACK_CANARY;
+
+    t->max_wait    = 0;
+    t->preemptions = 0;
 
-    return idx;
+    int id = t->id;
+    make_ready(pick_hart(), t);
+    intr_restore(irq);
+    return id;
 }
 
-/* picks tasks round robin style*/
-static int pick_next_runnable(void)
+int task_create_prio(task_entry_t entry, int priority)
 {
-    if (current < 0)
-        current = 0;
+    return task_create_ex(entry, priority, STACK_SIZE);
+}
 
-    for (int n = 0; n < MAX_TASKS; n++) {
-        int idx = (current + 1 + n) % MAX_TASKS;
-        if (tasks[idx].state == TASK_READY)
-            return idx;
-    }
-    return -1;
+int task_create(task_entry_t entry)
+{
+    return task_create_prio(entry, TASK_PRIO_DEFAULT);
+}
+
+/* the task running on this hart, 0 in kmain and on an idle hart */
+task_t *sched_current(void)
+{
+    uint32_t irq = intr_save();
+    task_t *t = this_hart()->current;
+    intr_restore(irq);
+    return t;
 }
+
 /* prints the ID of running tasks*/
 int current_task_id(void)
 {
-    return current;
+    task_t *t = sched_current();
+    return t ? t->id : -1;
 }
-/* when a task is running it calls this to give up the CPU for other tasks*/
-void task_yield(void)
+
+/* picks what runs next on h after p, whose state says whether it can keep going: still
+RUNNING for a yield, BLOCKED or FINISHED otherwise (or already READY, if it was woken before
+we got here). interrupts must be off */
+static void schedule(hart_t *h, task_t *p)
 {
-    int prev = current;
-    int next = pick_next_runnable();
+    spinlock_lock(&h->lock);
+    int best = best_ready_priority(h);
 
-    if (prev < 0) return; /* not started yet */
+    /* nothing as important is ready, a task that can still run just keeps going.
+    with equal priorities this is round robin, a better priority task always goes first */
+    if (p->state == TASK_RUNNING) {
+        if (best > p->priority) {
+            spinlock_unlock(&h->lock);
+            return;
+        }
+        p->state = TASK_READY;
+        p->ready_since = timer_now();
+        ready_push(h, p);
+    }
+
+    if (best == NUM_PRIORITIES) {
+        /* nothing left here, the idle context looks for work on the other harts. if p was
+        woken meanwhile it is on another hart's queue and runs there once we are off its stack */
+        spinlock_unlock(&h->lock);
+        h->current = 0;
+        h->prev = p;
+        context_switch(&p->ctx, &h->idle_ctx);
+        finish_switch();
+        return;
+    }
+
+    task_t *n = ready_pop(h, best);
+    spinlock_unlock(&h->lock);
 
-    if (next < 0) {
-        /* No runnable tasks, go back to kernel */
-        current = -1;
-        context_switch(&tasks[prev].ctx, &kernel_ctx);
+    /* woken again before it got as far as switching away, it just carries on */
+    if (n == p) {
+        p->state = TASK_RUNNING;
         return;
     }
+    switch_to(h, p, n);
+}
+
+/* when a task is running it calls this to give up the CPU for other tasks. the timer interrupt
+calls it too, so interrupts are off while the run queues are changed and the old state is put back
+once this task is switched back in*/
+void task_yield(void)
+{
+    uint32_t irq = intr_save();
+    hart_t *h = this_hart();
+    task_t *p = h->current;
+
+    if (p) /* not started yet or idle otherwise */
+        schedule(h, p);
+    intr_restore(irq);
+}
 
-    if (next == prev)
-        return; /* only one runnable */
+/* timer interrupt, the running task's time slice is up so it is preempted.
+runs in the trap handler on the task's own stack, the trap frame underneath brings it back*/
+void sched_tick(void)
+{
+    task_t *t = this_hart()->current;
+    if (!t)
+        return;
+    t->preemptions++;
+    task_yield();
+}
 
-    tasks[prev].state = TASK_READY;
-    tasks[next].state = TASK_RUNNING;
+void wait_queue_init(wait_queue_t *q)
+{
+    q->head = 0;
+    q->tail = 0;
+}
 
-    current = next;
-    context_switch(&tasks[prev].ctx, &tasks[next].ctx);
+int wait_queue_empty(wait_queue_t *q)
+{
+    return q->head == 0;
 }
 
+/* parks the running task at the back of q and switches to the next ready one. lock is only
+dropped once the task is on q, so a waker that takes it afterwards always finds it */
+void sched_sleep(wait_queue_t *q, spinlock_t *lock)
+{
+    hart_t *h = this_hart();
+    task_t *t = h->current;
+    if (!t)
+        return;
+    t->next = 0;
+    if (q->tail)
+        q->tail->next = t;
+    else
+        q->head = t;
+    q->tail = t;
+    t->state = TASK_BLOCKED;
+    spinlock_unlock(lock);
+    schedule(h, t);
+    spinlock_lock(lock);
+}
 
-/* begin tasks */
-void scheduler_start(void)
+/* makes the task that has waited longest ready again on the hart it last ran on, returns it or 0
+if q is empty. the caller decides whether to yield to it */
+task_t *sched_wake_one(wait_queue_t *q)
 {
-    int next = -1;
-    for (int i = 0; i < MAX_TASKS; i++) {
-        if (tasks[i].state == TASK_READY) {
-            next = i;
-            break;
+    task_t *t = q->head;
+    if (!t)
+        return 0;
+    q->head = t->next;
+    if (!q->head)
+        q->tail = 0;
+    make_ready(&harts[t->hart], t);
+    return t;
+}
+
+/* wakes every task on q, returns how many */
+int sched_wake_all(wait_queue_t *q)
+{
+    int n = 0;
+    while (sched_wake_one(q))
+        n++;
+    return n;
+}
+
+/* takes the best ready task from the hart with the most waiting, or 0 if every queue is empty.
+only harts that have checked in are looked at. only one hart's lock is held at a time, so two
+idle harts stealing from each other can't deadlock */
+static task_t *steal(hart_t *h)
+{
+    hart_t *victim = 0;
+    uint32_t most = 0;
+    for (uint32_t i = 0; i < NR_HARTS; i++) {
+        if (&harts[i] != h && harts[i].online && harts[i].nr_ready > most) {
+            most = harts[i].nr_ready;
+            victim = &harts[i];
+        }
+    }
+    if (!victim)
+        return 0;
+
+    task_t *t = 0;
+    spinlock_lock(&victim->lock);
+    if (victim->ready_bitmap)
+        t = ready_pop(victim, best_ready_priority(victim));
+    spinlock_unlock(&victim->lock);
+    if (t) {
+        t->hart = (int)h->id;
+        h->steals++;
+    }
+    return t;
+}
+
+/* the idle context of hart h, with interrupts off. runs whatever is ready here, then whatever
+can be stolen, and otherwise waits for an interrupt. wfi returns with interrupts still off,
+turning them on for a moment lets the handler run. hart 0 comes back out once every task is gone */
+static void idle_loop(hart_t *h)
+{
+    for (;;) {
+        task_t *n = 0;
+        spinlock_lock(&h->lock);
+        if (h->ready_bitmap)
+            n = ready_pop(h, best_ready_priority(h));
+        spinlock_unlock(&h->lock);
+        if (!n)
+            n = steal(h);
+
+        if (n) {
+            switch_to(h, 0, n);
+            h->current = 0;
+            continue;
         }
+        if (h->id == 0 && tasks_live == 0)
+            return;
+        __asm__ volatile ("wfi");
+        intr_on();
+        intr_save();
     }
+}
 
-    if (next < 0) {
+/* begin tasks, hart 0 comes back here once every task has finished */
+void scheduler_start(void)
+{
+    uint32_t irq = intr_save();
+    if (tasks_live == 0) {
         uart_puts("scheduler_start: no tasks\n");
+        intr_restore(irq);
         return;
     }
 
-    current = next;
-    tasks[next].state = TASK_RUNNING;
-
     uart_puts("scheduler_start: switching to first task\n");
-    context_switch(&kernel_ctx, &tasks[next].ctx);
+    idle_loop(this_hart());
+    intr_restore(irq);
+}
+
+/* a released hart's scheduler, it never returns */
+void sched_run_hart(uint32_t hartid)
+{
+    intr_save();
+    hart_t *h = &harts[hartid];
+    h->online = 1;
+    uart_printf("hart %d online\n", (int)hartid);
+    idle_loop(h);
+    for (;;) {
+        __asm__ volatile ("wfi");
+    }
 }
 
-/* all tasks start here after context switch, identifies current tasks, calls entry(), mark the state as FINISHED, try to give the CPU up then of no other tasks
-switch back to the kernel*/
+/* prints how much of the task and stack pools is in use and how busy each hart was, kind of like "ps" but only the totals */
+void sched_stats(void)
+{
+    uint32_t irq = spinlock_lock_irqsave(&pool_lock);
+    uart_printf("Tasks: %d of %d in use, %d reaped\n",
+                (int)task_pool.used, MAX_TASKS, (int)tasks_reaped);
+    for (int c = 0; c < STACK_CLASSES; c++) {
+        uart_printf("  %d byte stacks: %d of %d in use\n",
+                    STACK_MIN << c, (int)stack_pool[c].used, stack_class_count[c]);
+    }
+    spinlock_unlock_irqrestore(&pool_lock, irq);
+
+    for (uint32_t i = 0; i < MAX_HARTS; i++) {
+        if (harts[i].online)
+            uart_printf("  hart %d: %d switches, %d tasks stolen\n",
+                        (int)i, (int)harts[i].switches, (int)harts[i].steals);
+    }
+}
+
+/* all tasks start here after context switch, identifies current tasks, calls entry(), mark the state as FINISHED, then give the CPU up.
+the hart reaps it once it is running on another stack*/
 static void task_trampoline(void)
 {
-    int id = current;
-    if (id < 0 || id >= MAX_TASKS)
+    /* we got here through switch_to, so finish what it started */
+    finish_switch();
+    /* the first switch into a task happens with interrupts off, so preemption starts here */
+    intr_on();
+
+    task_t *t = sched_current();
+    if (!t)
         return;
 
-    task_t *t = &tasks[id];
     if (t->entry)
         t->entry();
 
+    uart_printf("task %d finished (preempted %d times, max wait %d us)\n",
+                t->id, (int)t->preemptions, (int)timer_us(t->max_wait));
+    intr_save();
     t->state = TASK_FINISHED;
-    uart_printf("task %d finished\n", id);
+    schedule(this_hart(), t);
 
-    /* Look for another runnable task or return to kernel */
-    task_yield();
-
-    /* If we reach here, no more tasks: switch back to kernel */
-    context_switch(&t->ctx, &kernel_ctx);
+    /* never reached, a finished task is never switched back in */
+    for (;;) {
+        __asm__ volatile ("wfi");
+    }
 }
@@ -1,5 +1,7 @@
 #pragma once
 #include <stdint.h>
+#include "smp.h"
+#include "sync.h"
 
 typedef void (*task_entry_t)(void);
 
@@ -7,7 +9,8 @@ typedef enum {
     TASK_UNUSED = 0,
     TASK_READY,
     TASK_RUNNING,
-    TASK_FINISHED
+    TASK_BLOCKED,    /* asleep on a wait queue until something wakes it */
+    TASK_FINISHED    /* done, reaped as soon as its hart is off its stack */
 } task_state_t;
 
 typedef struct context {
@@ -27,22 +30,76 @@ typedef struct context {
     uint32_t s11;
 } context_t;
 
-#define MAX_TASKS   4
-#define STACK_SIZE  1024
+#define MAX_TASKS   256
+
+/* Stacks come in power of two size classes from STACK_MIN up, each class is a pool
+of STACK_CLASS_COUNTS stacks. STACK_SIZE is what task_create and task_create_prio use.
+a preempted task also carries a 144 byte trap frame and the whole trap handler and scheduler
+call chain under it, so the smallest stack is 2 KB. the lowest word of every stack holds
+STACK_CANARY, it is checked each time a hart switches away from the task */
+#define STACK_MIN           2048
+#define STACK_CLASSES       4
+/* together the classes hold MAX_TASKS stacks, so every TCB can get one */
+#define STACK_COUNT_0       152
+#define STACK_COUNT_1       64
+#define STACK_COUNT_2       32
+#define STACK_COUNT_3       8
+#define STACK_CLASS_COUNTS  { STACK_COUNT_0, STACK_COUNT_1, STACK_COUNT_2, STACK_COUNT_3 }
+#define STACK_SIZE          STACK_MIN
+#define STACK_CANARY        0x57ac4ca7u
+
+/* 0 is the most important priority, there is one ready queue per priority */
+#define NUM_PRIORITIES     32
+#define TASK_PRIO_DEFAULT  16
 
 typedef struct task {
     int          id;
     task_state_t state;
     context_t    ctx;
     task_entry_t entry;
-    uint8_t      stack[STACK_SIZE];
+    int          priority;
+    struct task *next;       /* ready queue, wait queue or free list link */
+    /* scheduling latency: when the task last became ready and the longest it has waited */
+    uint64_t     ready_since;
+    uint64_t     max_wait;
+    uint32_t     preemptions;
+    uint8_t     *stack;
+    uint32_t     stack_size;
+    int          stack_class;
+    int          hart;       /* whose ready queue it goes back on, the one it last ran on */
+    /* set while a hart is running on the task's stack. a task can be made ready by another
+    hart before its own hart has switched away from it, nobody may switch to it until this is 0 */
+    volatile uint32_t on_cpu;
 } task_t;
 
+/* tasks blocked on something, in the order they went to sleep. linked through task_t.next,
+a blocked task is on no ready queue so the link is free. a wait queue has no lock of its own,
+it is protected by the lock of whatever it belongs to, which sleepers and wakers both hold */
+typedef struct wait_queue {
+    task_t *head;
+    task_t *tail;
+} wait_queue_t;
+
 void scheduler_init(void);
 int  task_create(task_entry_t entry);
+int  task_create_prio(task_entry_t entry, int priority);
+int  task_create_ex(task_entry_t entry, int priority, uint32_t stack_size);
 void scheduler_start(void);
+void sched_run_hart(uint32_t hartid);
 void task_yield(void);
+void sched_tick(void);
 int  current_task_id(void);
+task_t *sched_current(void);
+void sched_stats(void);
+
+/* wait queues, the caller holds the queue's lock with interrupts off. sched_sleep blocks the running
+task on q, drops lock and runs something else. it takes lock again before it returns, once another
+task or an interrupt handler has woken it */
+void    wait_queue_init(wait_queue_t *q);
+int     wait_queue_empty(wait_queue_t *q);
+void    sched_sleep(wait_queue_t *q, spinlock_t *lock);
+task_t *sched_wake_one(wait_queue_t *q);
+int     sched_wake_all(wait_queue_t *q);
 
 /* Implemented in assembly */
 void context_switch(context_t *old, context_t *new);
@@ -0,0 +1,51 @@
+/* kernel/smp.c */
+#include "smp.h"
+#include "irq.h"
+#include "riscv.h"
+#include "sched.h"
+#include "timer.h"
+
+/* writing 1 to a hart's msip raises a software interrupt on it, 0 clears it */
+#define CLINT_MSIP(h)   (CLINT_BASE + 4u * (h))
+
+/* set once the kernel is ready for the other harts, they wait on it in start.S */
+extern volatile uint32_t smp_release;
+
+uint32_t smp_hart_id(void)
+{
+    return csr_read(mhartid);
+}
+
+/* wakes hart h if it is sitting in wfi, used when work is queued for an idle hart */
+void smp_kick(uint32_t hartid)
+{
+    *(volatile uint32_t *)CLINT_MSIP(hartid) = 1;
+}
+
+/* the software interrupt only exists to end a wfi, so the handler just clears it */
+void smp_ipi(void)
+{
+    *(volatile uint32_t *)CLINT_MSIP(csr_read(mhartid)) = 0;
+}
+
+/* lets the parked harts into hart_main, the heap, fs and scheduler must be set up by then.
+each one waits in wfi with only its software interrupt enabled, so it is kicked as well.
+only the NR_HARTS the machine was started with are kicked, the CLINT has no msip for the rest */
+void smp_start(void)
+{
+    __atomic_store_n(&smp_release, 1, __ATOMIC_RELEASE);
+    for (uint32_t h = 0; h < NR_HARTS; h++) {
+        if (h != csr_read(mhartid))
+            smp_kick(h);
+    }
+}
+
+/* where the other harts start once they are released, they take tasks from the run
+queues and never come back */
+void hart_main(uint32_t hartid)
+{
+    smp_ipi();
+    trap_init();
+    timer_init(TIME_SLICE_MS);
+    sched_run_hart(hartid);
+}
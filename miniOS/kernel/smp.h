@@ -0,0 +1,25 @@
+#pragma once
+
+/* Harts. every hart starts at _start, hart 0 boots the kernel and the others wait in
+start.S until smp_start releases them. each one gets HART_STACK_SIZE bytes under _stack_top,
+hart 0's at the top. the build passes NR_HARTS, the number QEMU is started with (make run SMP=N),
+harts numbered NR_HARTS and up are parked for good. also included by start.S */
+#define MAX_HARTS        8
+#define HART_STACK_SIZE  8192
+
+#ifndef NR_HARTS
+#define NR_HARTS         1
+#endif
+#if NR_HARTS < 1 || NR_HARTS > MAX_HARTS
+#error "NR_HARTS must be between 1 and MAX_HARTS"
+#endif
+
+#ifndef __ASSEMBLER__
+#include <stdint.h>
+
+void     smp_start(void);
+void     hart_main(uint32_t hartid);
+void     smp_kick(uint32_t hartid);
+void     smp_ipi(void);
+uint32_t smp_hart_id(void);
+#endif
@@ -1,22 +1,80 @@
 #include "sync.h"
+#ifdef __riscv
+#include "riscv.h"
+#endif
 
 
-/* the spinlock locks at one and that means a critical section is being used, we need this because some parts of the code may
+/* the spinlock is held while owner != next and that means a critical section is being used, we need this because some parts of the code may
 be modifying data and others are trying to read/write to it */
 void spinlock_init(spinlock_t *l)
 {
-    l->locked = 0;
+    l->next = 0;
+    l->owner = 0;
 }
 
 void spinlock_lock(spinlock_t *l)
 {
-    /* Test-and-set spinlock */
-    while (__sync_lock_test_and_set(&l->locked, 1)) {
+    /* ticket spinlock, only the ticket taken here is waited for */
+    uint32_t ticket = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&l->owner, __ATOMIC_ACQUIRE) != ticket) {
         __asm__ volatile ("nop");
     }
 }
 
 void spinlock_unlock(spinlock_t *l)
 {
-    __sync_lock_release(&l->locked);
+    /* only the holder writes owner, so a plain increment is enough */
+    __atomic_store_n(&l->owner, l->owner + 1, __ATOMIC_RELEASE);
+}
+
+/* host builds (make kheap_bench) have no interrupts to turn off */
+uint32_t spinlock_lock_irqsave(spinlock_t *l)
+{
+#ifdef __riscv
+    uint32_t irq = intr_save();
+#else
+    uint32_t irq = 0;
+#endif
+    spinlock_lock(l);
+    return irq;
+}
+
+void spinlock_unlock_irqrestore(spinlock_t *l, uint32_t irq)
+{
+    spinlock_unlock(l);
+#ifdef __riscv
+    intr_restore(irq);
+#else
+    (void)irq;
+#endif
+}
+
+
+/* a reader takes the count with seqlock_read_begin, copies what it needs and then asks
+seqlock_read_retry whether a writer got in between. an odd start means a write was already going */
+void seqlock_init(seqlock_t *l)
+{
+    l->seq = 0;
+}
+
+uint32_t seqlock_read_begin(seqlock_t *l)
+{
+    return __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+}
+
+int seqlock_read_retry(seqlock_t *l, uint32_t start)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return (start & 1) || __atomic_load_n(&l->seq, __ATOMIC_RELAXED) != start;
+}
+
+void seqlock_write_begin(seqlock_t *l)
+{
+    __atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void seqlock_write_end(seqlock_t *l)
+{
+    __atomic_store_n(&l->seq, l->seq + 1, __ATOMIC_RELEASE);
 }
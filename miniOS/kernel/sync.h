@@ -1,10 +1,31 @@
 #pragma once
 #include <stdint.h>
 
+/* Spinning locks for short sections, including ones an interrupt handler also enters.
+anything that can wait a long time or calls task_yield should use the sleeping locks in wait.h */
+
+/* ticket lock, a locker takes the next ticket and spins until owner reaches it. tickets are
+served in order, so a spinner only waits for the holders ahead of it and can't be starved */
 typedef struct {
-    volatile uint32_t locked;
+    volatile uint32_t next;
+    volatile uint32_t owner;
 } spinlock_t;
 
+/* sequence lock for data that is read much more than written. the count is odd while
+a write is in progress, a reader that saw it change retries. writers need their own lock */
+typedef struct {
+    volatile uint32_t seq;
+} seqlock_t;
+
 void spinlock_init(spinlock_t *l);
 void spinlock_lock(spinlock_t *l);
 void spinlock_unlock(spinlock_t *l);
+/* also turns interrupts off, so the holder can't be preempted while others spin */
+uint32_t spinlock_lock_irqsave(spinlock_t *l);
+void     spinlock_unlock_irqrestore(spinlock_t *l, uint32_t irq);
+
+void     seqlock_init(seqlock_t *l);
+uint32_t seqlock_read_begin(seqlock_t *l);
+int      seqlock_read_retry(seqlock_t *l, uint32_t start);
+void     seqlock_write_begin(seqlock_t *l);
+void     seqlock_write_end(seqlock_t *l);
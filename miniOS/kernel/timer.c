@@ -1,5 +1,73 @@
 /* kernel/timer.c */
-void init_timer(void) {
-    /* If PIT/APIC not required for baseline, do nothing.
-       For scheduling later, program PIT and install IRQ handler. */
+#include "timer.h"
+#include "riscv.h"
+#include "sched.h"
+
+/* the CLINT on QEMU virt, mtime is shared and each hart has its own mtimecmp.
+the timer interrupt stays pending while mtime >= mtimecmp, so the handler pushes mtimecmp forward*/
+#define CLINT_MTIMECMP(h) (CLINT_BASE + 0x4000u + 8u * (h))
+#define CLINT_MTIME       (CLINT_BASE + 0xBFF8u)
+
+static uint32_t slice_ticks;
+static volatile uint32_t ticks;
+
+/* mtime is 64 bits but we can only read 32 at a time, read hi again to catch a carry between the halves */
+uint64_t timer_now(void)
+{
+    volatile uint32_t *mtime = (volatile uint32_t *)CLINT_MTIME;
+    uint32_t hi, lo;
+    do {
+        hi = mtime[1];
+        lo = mtime[0];
+    } while (mtime[1] != hi);
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* writing the low half first could fire early with the old high half, so hi is maxed out while lo changes */
+static void timer_set_cmp(uint64_t when)
+{
+    volatile uint32_t *cmp = (volatile uint32_t *)CLINT_MTIMECMP(csr_read(mhartid));
+    cmp[1] = 0xffffffffu;
+    cmp[0] = (uint32_t)when;
+    cmp[1] = (uint32_t)(when >> 32);
+}
+
+void timer_set_slice(uint32_t slice_ms)
+{
+    if (slice_ms == 0)
+        slice_ms = 1;
+    slice_ticks = slice_ms * (TIMER_HZ / 1000u);
+}
+
+/* arms the first tick on this hart and turns on timer interrupts, trap_init must have run first*/
+void timer_init(uint32_t slice_ms)
+{
+    timer_set_slice(slice_ms);
+    timer_set_cmp(timer_now() + slice_ticks);
+    csr_set(mie, MIE_MTIE);
+    intr_on();
+}
+
+/* number of time slices since timer_init, counted by hart 0 only so it doesn't run faster with more harts */
+uint32_t timer_ticks(void)
+{
+    return ticks;
+}
+
+/* mtime ticks to microseconds. the divide is done in 32 bits because a 64-bit one can turn into
+a __udivdi3 call and we don't link libgcc. deltas past 32 bits (about 7 minutes) are clamped */
+uint32_t timer_us(uint64_t mtime_delta)
+{
+    uint32_t d = mtime_delta > 0xffffffffu ? 0xffffffffu : (uint32_t)mtime_delta;
+    return d / (TIMER_HZ / 1000000u);
+}
+
+/* machine timer interrupt, called from trap_handler. the next deadline is set from now
+rather than the old deadline, so a long stretch with interrupts off doesn't cause a burst of ticks*/
+void timer_interrupt(void)
+{
+    timer_set_cmp(timer_now() + slice_ticks);
+    if (csr_read(mhartid) == 0)
+        ticks++;
+    sched_tick();
 }
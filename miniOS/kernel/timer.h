@@ -0,0 +1,17 @@
+#pragma once
+#include <stdint.h>
+
+/* length of a time slice, set it at build time with make TIME_SLICE_MS=N */
+#ifndef TIME_SLICE_MS
+#define TIME_SLICE_MS 10
+#endif
+
+/* mtime on QEMU virt counts at 10 MHz */
+#define TIMER_HZ 10000000u
+
+void     timer_init(uint32_t slice_ms);
+void     timer_set_slice(uint32_t slice_ms);
+uint64_t timer_now(void);
+uint32_t timer_ticks(void);
+uint32_t timer_us(uint64_t mtime_delta);
+void     timer_interrupt(void);
@@ -2,13 +2,47 @@
 #include <stdarg.h>
 #include "uart.h"
 #include "common.h"
+#include "plic.h"
+#include "riscv.h"
+#include "sched.h"
+#include "sync.h"
 
 /* the memory mapped UART will be at this base address, THR is the register that writes to send bytes while the LSR reads the bits
 LSR_THRE means THR is empty and it can write new char*/
 #define UART_BASE   0x10000000u
+#define UART_RBR    0u
 #define UART_THR    0u
+#define UART_IER    1u
+#define UART_FCR    2u
+#define UART_LCR    3u
 #define UART_LSR    5u
+#define UART_LSR_DR   (1u << 0)
 #define UART_LSR_THRE (1u << 5)
+#define UART_IER_RX   (1u << 0)    /* received data available */
+#define UART_IER_TX   (1u << 1)    /* THR empty */
+/* bytes the transmit FIFO takes each time THR goes empty */
+#define UART_FIFO     16
+
+
+/* Output goes into tx_buf and the THR empty interrupt moves it to the UART, so printing only
+costs a copy. a task that fills the buffer sleeps until the interrupt makes room, with interrupts
+off (or before the scheduler runs) the oldest bytes are pushed out by polling instead.
+input is echoed and edited in rx_line, finished lines move to rx_buf for uart_getline */
+static char         tx_buf[UART_TX_BUF];
+static uint32_t     tx_head, tx_tail;     /* free running, index with % UART_TX_BUF */
+static wait_queue_t tx_space;
+
+static char         rx_line[UART_LINE_MAX];
+static uint32_t     rx_line_len;
+static char         rx_buf[UART_RX_BUF];
+static uint32_t     rx_head, rx_tail;
+static uint32_t     rx_lines;             /* complete lines waiting in rx_buf */
+static wait_queue_t rx_wait;
+
+static spinlock_t   uart_lock;
+static uint8_t      uart_ier;
+static int          uart_irq_on;
+static int          uart_panicked;
 
 
 /* this function returns a pointer to the MMIO register, this tells us the base address + offset to help with the rest of our code
@@ -18,50 +52,231 @@ static inline volatile uint8_t *uart_reg(unsigned offset)
     return (volatile uint8_t *)(UART_BASE + offset);
 }
 
-/* UART defaults aren't guaranteed so we just set them, FIFO is used the prevent characters being lost through buffering inside UART.*/
+/* UART defaults aren't guaranteed so we just set them, FIFO is used the prevent characters being lost through buffering inside UART.
+the UART's own interrupts stay off until uart_irq_init, output is buffered until then*/
 void uart_init(void)
 {
-    /* Minimal init: 8N1, enable FIFO.
-       On QEMU virt this is enough to talk over serial. */
-    volatile uint8_t *lcr = uart_reg(3);
-    volatile uint8_t *fcr = uart_reg(2);
+    *uart_reg(UART_IER) = 0;
+    *uart_reg(UART_LCR) = 0x03;   /* 8 data bits, 1 stop, no parity */
+    *uart_reg(UART_FCR) = 0x07;   /* enable FIFO and clear both sides */
 
-    *lcr = 0x03;   /* 8 data bits, 1 stop, no parity */
-    *fcr = 0x01;   /* enable FIFO */
+    spinlock_init(&uart_lock);
+    wait_queue_init(&tx_space);
+    wait_queue_init(&rx_wait);
+    tx_head = tx_tail = 0;
+    rx_head = rx_tail = 0;
+    rx_line_len = 0;
+    rx_lines = 0;
+    uart_ier = 0;
+    uart_irq_on = 0;
+    uart_panicked = 0;
 }
 
-/* Sends single characters to UART, THR must be empty before writing the next char 
-the while loop reads LSR until THRE is empty and ready for more bytes.*/
-void uart_putc(char c)
+/* routes the UART through the PLIC and turns on its receive interrupt, plic_init must have run */
+void uart_irq_init(void)
 {
-    volatile uint8_t *thr = uart_reg(UART_THR);
-    volatile uint8_t *lsr = uart_reg(UART_LSR);
+    uint32_t irq = spinlock_lock_irqsave(&uart_lock);
+    plic_enable(PLIC_IRQ_UART0);
+    uart_irq_on = 1;
+    uart_ier = UART_IER_RX;
+    *uart_reg(UART_IER) = uart_ier;
+    spinlock_unlock_irqrestore(&uart_lock, irq);
+}
 
-    /* Wait until THR empty */
-    while ((*lsr & UART_LSR_THRE) == 0)
+/* Sends single characters to UART, THR must be empty before writing the next char
+the while loop reads LSR until THRE is empty and ready for more bytes. only the polled paths use this*/
+static void uart_putc_sync(char c)
+{
+    while ((*uart_reg(UART_LSR) & UART_LSR_THRE) == 0)
         ;
+    *uart_reg(UART_THR) = (uint8_t)c;
+}
+
+/* the THR empty interrupt only comes while UART_IER_TX is set, so it is on exactly while
+tx_buf has something in it. uart_lock must be held */
+static void uart_set_tx_irq(int on)
+{
+    uint8_t ier = on ? (uart_ier | UART_IER_TX) : (uart_ier & ~UART_IER_TX);
+    if (ier != uart_ier && uart_irq_on) {
+        uart_ier = ier;
+        *uart_reg(UART_IER) = ier;
+    }
+}
+
+/* moves bytes from tx_buf into the UART while it has room, uart_lock must be held */
+static void uart_tx_fill(void)
+{
+    int n = 0;
+    if (*uart_reg(UART_LSR) & UART_LSR_THRE) {
+        while (n < UART_FIFO && tx_tail != tx_head) {
+            *uart_reg(UART_THR) = (uint8_t)tx_buf[tx_tail++ % UART_TX_BUF];
+            n++;
+        }
+    }
+    if (tx_tail == tx_head)
+        uart_set_tx_irq(0);
+}
+
+/* queues n bytes, turning \n into \r\n. uart_lock is held with interrupts saved in *irq */
+static void uart_tx_queue(const char *s, uint32_t n, uint32_t *irq)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        int crlf = s[i] == '\n';
+        while (tx_head - tx_tail + 1 + crlf > UART_TX_BUF) {
+            if (*irq && uart_irq_on && sched_current()) {
+                /* full, sleep until the interrupt has sent some. uart_lock is only dropped
+                once we are on tx_space so the wakeup can't be missed */
+                uart_set_tx_irq(1);
+                sched_sleep(&tx_space, &uart_lock);
+            } else {
+                /* nothing will drain it for us, send the oldest byte by hand */
+                uart_putc_sync(tx_buf[tx_tail++ % UART_TX_BUF]);
+            }
+        }
+        if (crlf)
+            tx_buf[tx_head++ % UART_TX_BUF] = '\r';
+        tx_buf[tx_head++ % UART_TX_BUF] = s[i];
+    }
+    if (tx_head != tx_tail)
+        uart_set_tx_irq(1);
+}
+
+/* everything printed goes through here. after uart_panic, or if the UART never got its
+interrupt, it goes straight to the UART */
+static void uart_write(const char *s, uint32_t n)
+{
+    if (uart_panicked || !uart_irq_on) {
+        for (uint32_t i = 0; i < n; i++) {
+            if (s[i] == '\n')
+                uart_putc_sync('\r');
+            uart_putc_sync(s[i]);
+        }
+        return;
+    }
+    uint32_t irq = spinlock_lock_irqsave(&uart_lock);
+    uart_tx_queue(s, n, &irq);
+    spinlock_unlock_irqrestore(&uart_lock, irq);
+}
 
-    *thr = (uint8_t)c;
+void uart_putc(char c)
+{
+    uart_write(&c, 1);
 }
 
 /* this sends a string over the UART for logs and other messages where we would need strings.*/
 void uart_puts(const char *s)
 {
-    while (*s) {
-        if (*s == '\n')
-            uart_putc('\r');
-        uart_putc(*s++);
+    uart_write(s, (uint32_t)kstrlen(s));
+}
+
+/* the system is going down, so the interrupt may never run again. turns UART interrupts off,
+pushes out what is buffered and makes every later print synchronous*/
+void uart_panic(void)
+{
+    intr_save();
+    uart_panicked = 1;
+    *uart_reg(UART_IER) = 0;
+    while (tx_tail != tx_head)
+        uart_putc_sync(tx_buf[tx_tail++ % UART_TX_BUF]);
+}
+
+/* a received byte. printable ones are echoed and added to the line being typed, backspace takes
+one off and enter moves the line to rx_buf and wakes a reader. uart_lock must be held */
+static void uart_rx_byte(char c)
+{
+    uint32_t irq = 0;
+    if (c == '\r' || c == '\n') {
+        if (rx_head - rx_tail + rx_line_len + 1 > UART_RX_BUF)
+            return;    /* no reader is keeping up, the line is dropped when enter is hit */
+        for (uint32_t i = 0; i < rx_line_len; i++)
+            rx_buf[rx_head++ % UART_RX_BUF] = rx_line[i];
+        rx_buf[rx_head++ % UART_RX_BUF] = '\n';
+        rx_line_len = 0;
+        rx_lines++;
+        uart_tx_queue("\n", 1, &irq);
+        sched_wake_one(&rx_wait);
+    } else if (c == 0x7f || c == '\b') {
+        if (rx_line_len) {
+            rx_line_len--;
+            uart_tx_queue("\b \b", 3, &irq);
+        }
+    } else if (c >= ' ' && rx_line_len < UART_LINE_MAX - 1) {
+        rx_line[rx_line_len++] = c;
+        uart_tx_queue(&c, 1, &irq);
     }
 }
 
-/* this converts unsigned integers to ASCII and prints it using putc, it divides by base, converts the remainders into characters*/
-static void uart_print_uint(unsigned value, unsigned base)
+/* called by the trap handler when the PLIC says the UART wants attention, reads everything
+received and refills the transmit FIFO */
+void uart_interrupt(void)
+{
+    spinlock_lock(&uart_lock);
+    while (*uart_reg(UART_LSR) & UART_LSR_DR)
+        uart_rx_byte((char)*uart_reg(UART_RBR));
+
+    uint32_t used = tx_head - tx_tail;
+    uart_tx_fill();
+    if (tx_head - tx_tail < used)
+        sched_wake_all(&tx_space);
+    spinlock_unlock(&uart_lock);
+}
+
+/* reads one line typed on the console into buf without the newline and 0 terminates it,
+sleeps until a whole line is there. returns its length, a longer line is cut to max - 1 */
+int uart_getline(char *buf, int max)
+{
+    uint32_t irq = spinlock_lock_irqsave(&uart_lock);
+    while (rx_lines == 0) {
+        if (!sched_current()) {
+            spinlock_unlock_irqrestore(&uart_lock, irq);
+            return -1;    /* only a task can wait for input */
+        }
+        sched_sleep(&rx_wait, &uart_lock);
+    }
+    int n = 0;
+    for (;;) {
+        char c = rx_buf[rx_tail++ % UART_RX_BUF];
+        if (c == '\n')
+            break;
+        if (n < max - 1)
+            buf[n++] = c;
+    }
+    buf[n] = '\0';
+    rx_lines--;
+    spinlock_unlock_irqrestore(&uart_lock, irq);
+    return n;
+}
+
+/* uart_printf formats into a small buffer on the stack and hands it over whole, so a line
+takes the lock once instead of once per character */
+typedef struct {
+    char     buf[UART_FMT_CHUNK];
+    uint32_t len;
+} uart_fmt_t;
+
+static void fmt_putc(uart_fmt_t *o, char c)
+{
+    if (o->len == UART_FMT_CHUNK) {
+        uart_write(o->buf, o->len);
+        o->len = 0;
+    }
+    o->buf[o->len++] = c;
+}
+
+static void fmt_puts(uart_fmt_t *o, const char *s)
+{
+    while (*s)
+        fmt_putc(o, *s++);
+}
+
+/* this converts unsigned integers to ASCII, it divides by base, converts the remainders into characters*/
+static void fmt_uint(uart_fmt_t *o, unsigned value, unsigned base)
 {
     char buf[16];
     unsigned i = 0;
 
     if (value == 0) {
-        uart_putc('0');
+        fmt_putc(o, '0');
         return;
     }
 
@@ -72,18 +287,20 @@ static void uart_print_uint(unsigned value, unsigned base)
     }
 
     while (i--)
-        uart_putc(buf[i]);
+        fmt_putc(o, buf[i]);
 }
 
 /* this provides formatting to the printing, it goes through char by char and whenever it sees a % it processes that specifier*/
 void uart_printf(const char *fmt, ...)
 {
+    uart_fmt_t o;
+    o.len = 0;
     va_list ap;
     va_start(ap, fmt);
 
     while (*fmt) {
         if (*fmt != '%') {
-            uart_putc(*fmt++);
+            fmt_putc(&o, *fmt++);
             continue;
         }
 
@@ -95,30 +312,31 @@ void uart_printf(const char *fmt, ...)
         case 's': {
             const char *s = va_arg(ap, const char *);
             if (!s) s = "(null)";
-            uart_puts(s);
+            fmt_puts(&o, s);
         } break;
         case 'd': {
             int val = va_arg(ap, int);
+            unsigned u = (unsigned)val;
             if (val < 0) {
-                uart_putc('-');
-                val = -val;
+                fmt_putc(&o, '-');
+                u = 0u - u;
             }
-            uart_print_uint((unsigned)val, 10);
+            fmt_uint(&o, u, 10);
         } break;
         case 'x': {
             unsigned val = va_arg(ap, unsigned);
-            uart_print_uint(val, 16);
+            fmt_uint(&o, val, 16);
         } break;
         case 'c': {
             int c = va_arg(ap, int);
-            uart_putc((char)c);
+            fmt_putc(&o, (char)c);
         } break;
         case '%':
-            uart_putc('%');
+            fmt_putc(&o, '%');
             break;
         default:
-            uart_putc('%');
-            uart_putc(*fmt);
+            fmt_putc(&o, '%');
+            fmt_putc(&o, *fmt);
             break;
         }
 
@@ -126,5 +344,6 @@ void uart_printf(const char *fmt, ...)
     }
 
     va_end(ap);
+    if (o.len)
+        uart_write(o.buf, o.len);
 }
-
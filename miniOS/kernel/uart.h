@@ -1,7 +1,18 @@
 #pragma once
 #include <stdarg.h>
 
+/* transmit and receive buffer sizes, and the longest line uart_getline can return */
+#define UART_TX_BUF     4096
+#define UART_RX_BUF     256
+#define UART_LINE_MAX   128
+/* uart_printf hands the text over this many bytes at a time */
+#define UART_FMT_CHUNK  64
+
 void uart_init(void);
+void uart_irq_init(void);
+void uart_interrupt(void);
+void uart_panic(void);
 void uart_putc(char c);
 void uart_puts(const char *s);
 void uart_printf(const char *fmt, ...);
+int  uart_getline(char *buf, int max);
@@ -0,0 +1,194 @@
+/* kernel/wait.c */
+#include "wait.h"
+#include "riscv.h"
+
+/* every function here holds the object's spinlock with interrupts off while it looks at it,
+so neither the timer nor another hart can get in halfway, and an interrupt handler may wake
+tasks on the same queues */
+
+/* a task we just woke only gets the CPU early if it is more important than us,
+otherwise it waits its turn on the ready queue */
+static void yield_to(task_t *woken)
+{
+    task_t *me = sched_current();
+    if (woken && me && woken->priority < me->priority)
+        task_yield();
+}
+
+
+void mutex_init(mutex_t *m)
+{
+    spinlock_init(&m->lock);
+    m->locked = 0;
+    m->owner = 0;
+    wait_queue_init(&m->waiters);
+}
+
+void mutex_lock(mutex_t *m)
+{
+    uint32_t irq = spinlock_lock_irqsave(&m->lock);
+    if (!m->locked) {
+        m->locked = 1;
+        m->owner = sched_current();
+    } else {
+        /* mutex_unlock makes us the owner before waking us */
+        sched_sleep(&m->waiters, &m->lock);
+    }
+    spinlock_unlock_irqrestore(&m->lock, irq);
+}
+
+/* 1 if we got it, 0 if someone holds it */
+int mutex_trylock(mutex_t *m)
+{
+    uint32_t irq = spinlock_lock_irqsave(&m->lock);
+    int got = !m->locked;
+    if (got) {
+        m->locked = 1;
+        m->owner = sched_current();
+    }
+    spinlock_unlock_irqrestore(&m->lock, irq);
+    return got;
+}
+
+/* hands the mutex to the first waiter or frees it, m->lock must be held */
+static task_t *mutex_release(mutex_t *m)
+{
+    task_t *t = sched_wake_one(&m->waiters);
+    if (t) {
+        m->owner = t;    /* stays locked */
+    } else {
+        m->locked = 0;
+        m->owner = 0;
+    }
+    return t;
+}
+
+void mutex_unlock(mutex_t *m)
+{
+    uint32_t irq = spinlock_lock_irqsave(&m->lock);
+    task_t *t = mutex_release(m);
+    spinlock_unlock_irqrestore(&m->lock, irq);
+    yield_to(t);
+}
+
+
+void sem_init(semaphore_t *s, uint32_t count)
+{
+    spinlock_init(&s->lock);
+    s->count = count;
+    wait_queue_init(&s->waiters);
+}
+
+void sem_wait(semaphore_t *s)
+{
+    uint32_t irq = spinlock_lock_irqsave(&s->lock);
+    if (s->count > 0)
+        s->count--;
+    else
+        sched_sleep(&s->waiters, &s->lock);    /* sem_post gives the unit straight to us */
+    spinlock_unlock_irqrestore(&s->lock, irq);
+}
+
+/* safe from an interrupt handler, it never sleeps */
+void sem_post(semaphore_t *s)
+{
+    uint32_t irq = spinlock_lock_irqsave(&s->lock);
+    task_t *t = sched_wake_one(&s->waiters);
+    if (!t)
+        s->count++;
+    spinlock_unlock_irqrestore(&s->lock, irq);
+    yield_to(t);
+}
+
+
+void cond_init(condvar_t *c)
+{
+    spinlock_init(&c->lock);
+    wait_queue_init(&c->waiters);
+}
+
+/* we are on the condvar's queue before its lock is dropped, so a cond_signal from whoever
+takes the mutex next can't slip in between and get lost */
+void cond_wait(condvar_t *c, mutex_t *m)
+{
+    uint32_t irq = spinlock_lock_irqsave(&c->lock);
+    spinlock_lock(&m->lock);
+    mutex_release(m);
+    spinlock_unlock(&m->lock);
+    sched_sleep(&c->waiters, &c->lock);
+    spinlock_unlock_irqrestore(&c->lock, irq);
+    mutex_lock(m);
+}
+
+void cond_signal(condvar_t *c)
+{
+    uint32_t irq = spinlock_lock_irqsave(&c->lock);
+    sched_wake_one(&c->waiters);
+    spinlock_unlock_irqrestore(&c->lock, irq);
+}
+
+void cond_broadcast(condvar_t *c)
+{
+    uint32_t irq = spinlock_lock_irqsave(&c->lock);
+    sched_wake_all(&c->waiters);
+    spinlock_unlock_irqrestore(&c->lock, irq);
+}
+
+
+/* like the mutex the lock is handed over on release: the waker bumps state for the
+tasks it wakes, so they own it the moment they run */
+void rwlock_init(rwlock_t *l)
+{
+    spinlock_init(&l->lock);
+    l->state = 0;
+    wait_queue_init(&l->readers);
+    wait_queue_init(&l->writers);
+}
+
+void rwlock_read_lock(rwlock_t *l)
+{
+    uint32_t irq = spinlock_lock_irqsave(&l->lock);
+    if (l->state >= 0 && wait_queue_empty(&l->writers))
+        l->state++;
+    else
+        sched_sleep(&l->readers, &l->lock);
+    spinlock_unlock_irqrestore(&l->lock, irq);
+}
+
+void rwlock_read_unlock(rwlock_t *l)
+{
+    uint32_t irq = spinlock_lock_irqsave(&l->lock);
+    task_t *t = 0;
+    if (--l->state == 0) {
+        t = sched_wake_one(&l->writers);
+        if (t)
+            l->state = -1;
+    }
+    spinlock_unlock_irqrestore(&l->lock, irq);
+    yield_to(t);
+}
+
+void rwlock_write_lock(rwlock_t *l)
+{
+    uint32_t irq = spinlock_lock_irqsave(&l->lock);
+    if (l->state == 0)
+        l->state = -1;
+    else
+        sched_sleep(&l->writers, &l->lock);
+    spinlock_unlock_irqrestore(&l->lock, irq);
+}
+
+/* readers that queued behind this writer go next, all at once, then the next writer */
+void rwlock_write_unlock(rwlock_t *l)
+{
+    uint32_t irq = spinlock_lock_irqsave(&l->lock);
+    task_t *t = 0;
+    if (!wait_queue_empty(&l->readers)) {
+        l->state = sched_wake_all(&l->readers);
+    } else {
+        t = sched_wake_one(&l->writers);
+        l->state = t ? -1 : 0;
+    }
+    spinlock_unlock_irqrestore(&l->lock, irq);
+    yield_to(t);
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <stdint.h>
+#include "sched.h"
+#include "sync.h"
+
+/* Sleeping locks. A task that can't get one is put on the lock's wait queue and another task
+runs, so a contended lock costs a context switch instead of the rest of the time slice.
+release hands the lock straight to the task that has waited longest, it doesn't have to race
+new lockers for it. only tasks can sleep, kmain uses these before and after the scheduler
+runs when nothing else can be holding them. interrupt handlers must use spinlock_t.
+each one has a spinlock over its state and wait queue, held only while it is looked at */
+
+typedef struct mutex {
+    spinlock_t   lock;
+    uint32_t     locked;
+    task_t      *owner;
+    wait_queue_t waiters;
+} mutex_t;
+
+typedef struct semaphore {
+    spinlock_t   lock;
+    uint32_t     count;
+    wait_queue_t waiters;
+} semaphore_t;
+
+/* always used with a mutex, cond_wait drops it while asleep and takes it again before returning */
+typedef struct condvar {
+    spinlock_t   lock;
+    wait_queue_t waiters;
+} condvar_t;
+
+/* many readers or one writer. state is the number of readers, or -1 while a writer
+holds it. new readers wait while a writer is waiting so writers aren't starved, and the
+readers that queued up go in together once the writer is done so they aren't either */
+typedef struct rwlock {
+    spinlock_t   lock;
+    int32_t      state;
+    wait_queue_t readers;
+    wait_queue_t writers;
+} rwlock_t;
+
+void mutex_init(mutex_t *m);
+void mutex_lock(mutex_t *m);
+int  mutex_trylock(mutex_t *m);
+void mutex_unlock(mutex_t *m);
+
+void sem_init(semaphore_t *s, uint32_t count);
+void sem_wait(semaphore_t *s);
+void sem_post(semaphore_t *s);
+
+void cond_init(condvar_t *c);
+void cond_wait(condvar_t *c, mutex_t *m);
+void cond_signal(condvar_t *c);
+void cond_broadcast(condvar_t *c);
+
+void rwlock_init(rwlock_t *l);
+void rwlock_read_lock(rwlock_t *l);
+void rwlock_read_unlock(rwlock_t *l);
+void rwlock_write_lock(rwlock_t *l);
+void rwlock_write_unlock(rwlock_t *l);
@@ -0,0 +1,45 @@
+#!/bin/sh
+# tools/build_initramfs.sh [dir] [out]
+# packs every regular file under dir (default initramfs) into a newc cpio archive (default
+# intramfs.cpio), which kernel/initramfs_image.S links into the kernel. it writes the format itself
+# so the host doesn't need cpio. names are stored relative to dir, the kernel reads them as
+# read-only files of the same name
+set -e
+
+dir=${1:-initramfs}
+out=${2:-intramfs.cpio}
+
+# zero bytes up to the next multiple of 4
+pad() {
+    n=$(( (4 - $1 % 4) % 4 ))
+    if [ "$n" -gt 0 ]; then
+        dd if=/dev/zero bs=1 count="$n" 2>/dev/null
+    fi
+}
+
+# header, name and padding for one entry, the data comes after it. pos is the offset in
+# the archive, padding is counted from the start of the archive
+entry() {
+    name=$1 mode=$2 size=$3
+    namesize=$(( ${#name} + 1 ))
+    printf '070701%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X%08X' \
+        "$ino" "$mode" 0 0 1 0 "$size" 0 0 0 0 "$namesize" 0
+    printf '%s\000' "$name"
+    pad $(( 110 + namesize ))
+    ino=$(( ino + 1 ))
+}
+
+ino=1
+{
+    if [ -d "$dir" ]; then
+        (cd "$dir" && find . -type f | sed 's|^\./||' | LC_ALL=C sort) | while IFS= read -r f; do
+            size=$(wc -c < "$dir/$f" | tr -d ' ')
+            entry "$f" $(( 0100444 )) "$size"
+            cat "$dir/$f"
+            pad "$size"
+        done
+    fi
+    ino=0
+    entry "TRAILER!!!" 0 0
+} > "$out.tmp"
+mv "$out.tmp" "$out"
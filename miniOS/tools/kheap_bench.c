@@ -0,0 +1,168 @@
+/* tools/kheap_bench.c
+host benchmark for kernel/kheap.c, builds with make kheap_bench and runs without QEMU.
+the heap gets a malloc'd region the size of the kernel's, and each test is compared against libc malloc */
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "kheap.h"
+
+#define HEAP_BYTES  (64u * 1024u * 1024u)
+#define LIVE        4096
+#define ROUNDS      256
+#define MIX_OPS     2000000
+
+/* kheap.c prints through the UART driver, on the host that is stdout */
+void uart_puts(const char *s)
+{
+    fputs(s, stdout);
+}
+
+void uart_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t rng_state = 1;
+
+/* splitmix64 so every run does the same sequence of sizes */
+static uint64_t rng_next(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static void *slots[LIVE];
+
+/* up to LIVE allocations of one size (no more than a quarter of the heap) then frees in the
+same order, repeated ROUNDS times. returns ns per alloc + free pair */
+static double bench_fixed(size_t size, int use_libc)
+{
+    int live = LIVE;
+    if (size * live > HEAP_BYTES / 4)
+        live = (int)(HEAP_BYTES / 4 / size);
+    uint64_t start = now_ns();
+    for (int r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < live; i++) {
+            slots[i] = use_libc ? malloc(size) : kmalloc(size);
+            if (!slots[i]) {
+                fprintf(stderr, "out of memory at size %zu\n", size);
+                exit(1);
+            }
+            *(volatile char *)slots[i] = 1;
+        }
+        for (int i = 0; i < live; i++) {
+            if (use_libc)
+                free(slots[i]);
+            else
+                kfree(slots[i]);
+        }
+    }
+    return (double)(now_ns() - start) / ((double)ROUNDS * live);
+}
+
+/* random sizes from 16 bytes to 16 KB with a random slot freed before each allocation,
+so the heap stays about LIVE objects full and gets fragmented. returns ns per op and the worst single op */
+static double bench_mixed(int use_libc, uint64_t *worst_ns)
+{
+    memset(slots, 0, sizeof(slots));
+    rng_state = 1;
+    *worst_ns = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < MIX_OPS; i++) {
+        int slot = (int)(rng_next() % LIVE);
+        size_t size = (size_t)16 << (rng_next() % 11);
+        uint64_t t0 = (i & 1023) == 0 ? now_ns() : 0;
+        if (use_libc) {
+            free(slots[slot]);
+            slots[slot] = malloc(size);
+        } else {
+            kfree(slots[slot]);
+            slots[slot] = kmalloc(size);
+        }
+        if (t0) {
+            uint64_t took = now_ns() - t0;
+            if (took > *worst_ns)
+                *worst_ns = took;
+        }
+    }
+    double per_op = (double)(now_ns() - start) / MIX_OPS;
+    if (!use_libc) {
+        uart_puts("\nheap with the mixed workload still allocated:\n");
+        kheap_dump();
+    }
+    for (int i = 0; i < LIVE; i++) {
+        if (use_libc)
+            free(slots[i]);
+        else
+            kfree(slots[i]);
+        slots[i] = 0;
+    }
+    return per_op;
+}
+
+int main(void)
+{
+    void *region = aligned_alloc(PAGE_SIZE, HEAP_BYTES);
+    if (!region) {
+        fprintf(stderr, "could not get %u bytes for the heap\n", HEAP_BYTES);
+        return 1;
+    }
+    /* fault the region in up front, and stop glibc from handing memory back to the
+    OS between rounds, so neither side is timing page faults */
+    memset(region, 0, HEAP_BYTES);
+#ifdef __GLIBC__
+    mallopt(M_TRIM_THRESHOLD, HEAP_BYTES);
+    mallopt(M_MMAP_THRESHOLD, HEAP_BYTES);
+#endif
+    kheap_init(region, (uint8_t *)region + HEAP_BYTES);
+
+    kheap_stats_t before, after;
+    kheap_get_stats(&before);
+
+    printf("%8s %14s %14s\n", "size", "kheap ns/pair", "malloc ns/pair");
+    static const size_t sizes[] = {16, 64, 256, 1024, 2048, 4096, 16384, 65536};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double k = bench_fixed(sizes[i], 0);
+        double m = bench_fixed(sizes[i], 1);
+        printf("%8zu %14.1f %14.1f\n", sizes[i], k, m);
+    }
+
+    uint64_t k_worst, m_worst;
+    double k = bench_mixed(0, &k_worst);
+    double m = bench_mixed(1, &m_worst);
+    printf("\nmixed 16 B - 16 KB, %d live: kheap %.1f ns/op (worst sampled %llu ns), "
+           "malloc %.1f ns/op (worst sampled %llu ns)\n",
+           LIVE, k, (unsigned long long)k_worst, m, (unsigned long long)m_worst);
+
+    /* everything was freed, so apart from the spare empty slab each cache keeps
+    the heap has to be back where it started */
+    kheap_get_stats(&after);
+    printf("\nafter freeing everything: %u of %u pages free (%u in cached empty slabs), fragmentation %u%%\n",
+           after.free_pages, after.total_pages, after.slab_pages, after.fragmentation_pct);
+    if (after.free_pages + after.slab_pages != before.free_pages || after.large_pages != 0) {
+        fprintf(stderr, "leak: %u pages unaccounted for\n",
+                before.free_pages - after.free_pages - after.slab_pages);
+        return 1;
+    }
+    free(region);
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include "uart.h"
 #include "fs.h"
 #include "sched.h"
+#include "timer.h"
 
 
 /* sipmle tasks to make sure its getting the task ID, opening and reading the file and multitasking using task_yield()*/
@@ -21,6 +22,7 @@ void user_hello(void)
         } else {
             uart_puts("[hello] fs_read failed\n");
         }
+        fs_close(fd);
     } else {
         uart_puts("[hello] fs_open failed\n");
     }
@@ -36,10 +38,34 @@ void user_counter(void)
     int tid = current_task_id();
     uart_printf("[counter] task %d starting\n", tid);
 
+    /* every step is also appended to a log file, each append only touches the last block */
+    int log = fs_create("counter.log", -1, 1u | 2u);
+    char line[] = "i = 0\n";
+
     for (int i = 0; i < 10; i++) {
         uart_printf("[counter] i = %d\n", i);
+        line[4] = (char)('0' + i);
+        if (log >= 0)
+            fs_append(log, line, sizeof(line) - 1);
         task_yield();
     }
+    if (log >= 0)
+        fs_close(log);
 
     uart_puts("[counter] done\n");
 }
+
+/* never yields, it spins until 20 time slices have gone by. the timer preempts it so the other tasks
+keep running, without preemption nothing else would run until it is done*/
+void user_spinner(void)
+{
+    int tid = current_task_id();
+    uart_printf("[spinner] task %d starting, never yields\n", tid);
+
+    uint32_t start = timer_ticks();
+    volatile uint32_t spins = 0;
+    while (timer_ticks() - start < 20)
+        spins++;
+
+    uart_printf("[spinner] done after %d spins\n", (int)spins);
+}
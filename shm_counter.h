@@ -0,0 +1,119 @@
+// Caleb Bright
+// Layout of the POSIX shared memory counter used by sloppySim --processes
+// and read live by sloppyReader. Both programs include this so they agree on
+// the layout; the magic and version are checked when attaching.
+#pragma once
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <string>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const uint64_t shm_counter_magic = 0x534c4f5050595348ULL;  // "SLOPPYSH"
+const uint32_t shm_counter_version = 1;
+const char* const shm_default_name = "/sloppySim";
+
+// Everything lives in one mapping. The lock and the counter share a cache
+// line on purpose, a flush touches both; the run info is read only after setup.
+struct Shm_Counter_Segment {
+    uint64_t magic;
+    uint32_t version;
+    // run info, written by the parent before forking
+    int32_t processes;
+    int32_t threads_per_process;
+    int32_t sloppiness;
+    char strategy[16];
+    int64_t start_ns;  // CLOCK_MONOTONIC, same clock in every process
+    // writer processes still running, and set to 1 once the parent has reaped them all
+    alignas(64) std::atomic<int32_t> running;
+    std::atomic<int32_t> done;
+    alignas(64) pthread_mutex_t mutex;
+    std::atomic<long long> total;
+    std::atomic<long long> flushes;
+};
+
+static_assert(std::atomic<long long>::is_always_lock_free,
+              "the counter must be lock free to work across processes");
+
+// creates (or replaces) the segment and sets up the process shared mutex,
+// nullptr on failure
+inline Shm_Counter_Segment* shm_counter_create(const std::string& name) {
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+        return nullptr;
+    if (ftruncate(fd, sizeof(Shm_Counter_Segment)) != 0) {
+        close(fd);
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    void* mem = mmap(nullptr, sizeof(Shm_Counter_Segment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(name.c_str());
+        return nullptr;
+    }
+    auto* seg = new (mem) Shm_Counter_Segment();
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    // a writer that dies holding the lock must not hang the others
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&seg->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    seg->total.store(0);
+    seg->flushes.store(0);
+    seg->running.store(0);
+    seg->done.store(0);
+    seg->version = shm_counter_version;
+    seg->magic = shm_counter_magic;
+    return seg;
+}
+
+// attaches to an existing segment read only, nullptr if it is missing or not ours
+inline const Shm_Counter_Segment* shm_counter_attach(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Shm_Counter_Segment))) {
+        close(fd);
+        return nullptr;
+    }
+    void* mem = mmap(nullptr, sizeof(Shm_Counter_Segment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return nullptr;
+    auto* seg = static_cast<const Shm_Counter_Segment*>(mem);
+    if (seg->magic != shm_counter_magic || seg->version != shm_counter_version) {
+        munmap(mem, sizeof(Shm_Counter_Segment));
+        return nullptr;
+    }
+    return seg;
+}
+
+// locks the process shared mutex, recovering it if the last owner died
+inline void shm_counter_lock(Shm_Counter_Segment* seg) {
+    if (pthread_mutex_lock(&seg->mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(&seg->mutex);
+}
+
+// try_lock version, false if another thread or process holds it
+inline bool shm_counter_try_lock(Shm_Counter_Segment* seg) {
+    int rc = pthread_mutex_trylock(&seg->mutex);
+    if (rc == EOWNERDEAD) {
+        pthread_mutex_consistent(&seg->mutex);
+        return true;
+    }
+    return rc == 0;
+}
+
+inline void shm_counter_unlock(Shm_Counter_Segment* seg) {
+    pthread_mutex_unlock(&seg->mutex);
+}
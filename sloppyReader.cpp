@@ -0,0 +1,63 @@
+// Caleb Bright
+// Attaches to the shared memory counter of a running sloppySim --processes
+// and prints it while the writers keep going. It only maps the segment read
+// only and never takes the lock, so it can't slow the writers down.
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <chrono>
+#include <string>
+#include "shm_counter.h"
+
+using namespace std;
+
+long long monotonic_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char* argv[]) {
+    string name = (argc > 1) ? argv[1] : shm_default_name;
+    int interval_ms = (argc > 2) ? stoi(argv[2]) : 100;
+    // how long to wait for sloppySim to create the segment
+    int attach_timeout_ms = (argc > 3) ? stoi(argv[3]) : 5000;
+
+    const Shm_Counter_Segment* seg = nullptr;
+    for (int waited = 0; !seg; waited += 10) {
+        seg = shm_counter_attach(name);
+        if (!seg && waited >= attach_timeout_ms) {
+            cerr << "Could not attach to " << name << "\n";
+            return 1;
+        }
+        if (!seg)
+            this_thread::sleep_for(chrono::milliseconds(10));
+    }
+
+    cout << "Attached to " << name << ": " << seg->processes << " processes x "
+         << seg->threads_per_process << " threads, sloppiness " << seg->sloppiness
+         << ", strategy " << seg->strategy << "\n";
+    cout << "time_ms,count,flushes,flush_rate,running_processes\n";
+
+    long long last_flushes = 0;
+    long long last_ns = monotonic_ns();
+    while (true) {
+        this_thread::sleep_for(chrono::milliseconds(interval_ms));
+        long long now = monotonic_ns();
+        long long count = seg->total.load(memory_order_relaxed);
+        long long flushes = seg->flushes.load(memory_order_relaxed);
+        int running = seg->running.load(memory_order_relaxed);
+        bool done = seg->done.load(memory_order_acquire) != 0;
+        double dt = (now - last_ns) / 1e9;
+
+        cout << fixed << setprecision(1) << (now - seg->start_ns) / 1e6 << ',' << count << ','
+             << flushes << ',' << setprecision(0) << (dt > 0 ? (flushes - last_flushes) / dt : 0)
+             << ',' << running << "\n" << flush;
+        last_flushes = flushes;
+        last_ns = now;
+
+        if (done)
+            break;
+    }
+    cout << "Writers finished, final count " << seg->total.load() << "\n";
+    return 0;
+}
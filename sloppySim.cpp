@@ -8,124 +8,1894 @@
 #include <cstring>
 #include <atomic>
 #include <cstdlib>
+#include <vector>
+#include <map>
+#include <memory>
+#include <set>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <queue>
+#include <condition_variable>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include "sloppy_counter.h"
+#include "shm_counter.h"
+#include "sloppy_locks.h"
+#include "sloppy_keyed.h"
 
 using namespace std;
 
-// All shared data that is used by threads
-struct Shared_Data {
+// number of log2 buckets in the wait histogram, bucket i counts waits in [2^i, 2^(i+1)) ns
+const int wait_histogram_buckets = 40;
+
+// per thread counters for --stats, kept in thread local storage while the
+// thread runs and copied into Shared_Data when it finishes
+struct Thread_Stats {
+    long long flushes = 0;
+    long long wait_ns = 0;
+    long long hold_ns = 0;
+    long long work_ns = 0;
+    long long wait_histogram[wait_histogram_buckets] = {};
+    // -1 means the counter was not available
+    long long context_switches = -1;
+    long long cache_misses = -1;
+    const char* switch_source = "none";
+};
+
+// set before the threads start, so it never changes while they read it
+bool stats_enabled = false;
+thread_local Thread_Stats tls_stats;
+
+long long now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// adds one flush's lock wait and hold time to this thread's stats
+void record_flush(long long wait_ns, long long hold_ns) {
+    tls_stats.wait_ns += wait_ns;
+    tls_stats.hold_ns += hold_ns;
+    int bucket = 0;
+    while (bucket < wait_histogram_buckets - 1 && (wait_ns >> (bucket + 1)) > 0)
+        bucket++;
+    tls_stats.wait_histogram[bucket]++;
+}
+
+// the counter type every engine in the simulation works on
+using Sim_Engine = Flush_Engine<long long>;
+
+// original design, takes the global lock and then adds to the global counter.
+// Lock is std::mutex unless --lock picks one from sloppy_locks.h
+template <typename Lock>
+struct Lock_Flush : Sim_Engine {
     atomic<long long> global_counter{0};
-    vector<long long> local_buckets;
-    int sloppiness;
-    int work_time;
-    int work_iterations;
-    bool cpu_bound;
-    bool do_logging;
-    mutex global_mutex;
+    Lock global_mutex;
+
+    // try_lock first so a held lock can be reported as contention
+    bool flush(int, long long amount) override {
+        long long t0 = stats_enabled ? now_ns() : 0;
+        bool contended = !global_mutex.try_lock();
+        if (contended)
+            global_mutex.lock();
+        long long t1 = stats_enabled ? now_ns() : 0;
+        global_counter.store(global_counter.load(memory_order_relaxed) + amount,
+                             memory_order_relaxed);
+        long long t2 = stats_enabled ? now_ns() : 0;
+        global_mutex.unlock();
+        if (stats_enabled)
+            record_flush(t1 - t0, t2 - t1);
+        return contended;
+    }
+    long long read() override { return global_counter.load(memory_order_relaxed); }
+};
+
+// no lock, every flush is one atomic add on the shared counter. A single CAS
+// is tried first so losing the race can be reported as contention
+struct Atomic_Flush : Sim_Engine {
+    atomic<long long> global_counter{0};
+
+    bool flush(int, long long amount) override {
+        // no lock to wait for, the time spent getting the cache line counts as wait
+        long long t0 = stats_enabled ? now_ns() : 0;
+        long long old = global_counter.load(memory_order_relaxed);
+        bool contended = !global_counter.compare_exchange_strong(old, old + amount,
+                                                                 memory_order_relaxed);
+        if (contended)
+            global_counter.fetch_add(amount, memory_order_relaxed);
+        if (stats_enabled)
+            record_flush(now_ns() - t0, 0);
+        return contended;
+    }
+    long long read() override { return global_counter.load(memory_order_relaxed); }
+};
+
+// one slot per thread, each on its own cache line
+struct alignas(cache_line_size) Padded_Slot {
+    atomic<long long> value{0};
+};
+
+// each thread only writes its own slot so there is no contention,
+// the reader has to add up every slot to get the total
+struct Sharded_Flush : Sim_Engine {
+    vector<Padded_Slot> slots;
+
+    explicit Sharded_Flush(int n_threads) : slots(n_threads) {}
+
+    bool flush(int thread_index, long long amount) override {
+        atomic<long long>& v = slots[thread_index].value;
+        v.store(v.load(memory_order_relaxed) + amount, memory_order_relaxed);
+        if (stats_enabled)
+            record_flush(0, 0);
+        return false;
+    }
+    long long read() override {
+        long long total = 0;
+        for (auto& s : slots)
+            total += s.value.load(memory_order_relaxed);
+        return total;
+    }
+};
+
+// where one CPU sits, the ids are made dense (0..n-1) by read_cpu_topology()
+struct Cpu_Info {
+    int cpu;
+    int core;
+    int llc;
+    int package;
+};
+
+// reads a whole sysfs file, empty if it isn't there
+string read_sys_file(const string& path) {
+    ifstream file(path);
+    string text;
+    getline(file, text);
+    return text;
+}
+
+// parses a kernel cpu list like "0-3,8,10-11"
+vector<int> parse_cpu_list(const string& text) {
+    vector<int> cpus;
+    stringstream ss(text);
+    string item;
+    while (getline(ss, item, ',')) {
+        if (item.empty())
+            continue;
+        size_t dash = item.find('-');
+        int lo = stoi(item.substr(0, dash));
+        int hi = (dash == string::npos) ? lo : stoi(item.substr(dash + 1));
+        for (int c = lo; c <= hi; ++c)
+            cpus.push_back(c);
+    }
+    return cpus;
+}
+
+// Reads the online CPUs and their core, last level cache and socket from
+// /sys/devices/system/cpu. The LLC is the highest cache index, named by the
+// first CPU sharing it. Anything missing falls back to one CPU per core on one socket.
+vector<Cpu_Info> read_cpu_topology() {
+    const string base = "/sys/devices/system/cpu/";
+    vector<int> online = parse_cpu_list(read_sys_file(base + "online"));
+    if (online.empty())
+        for (unsigned c = 0; c < max(1u, thread::hardware_concurrency()); ++c)
+            online.push_back(static_cast<int>(c));
+
+    map<pair<int, int>, int> core_ids;
+    map<int, int> llc_ids, package_ids;
+    vector<Cpu_Info> cpus;
+    for (int cpu : online) {
+        string dir = base + "cpu" + to_string(cpu) + "/";
+        string package_text = read_sys_file(dir + "topology/physical_package_id");
+        string core_text = read_sys_file(dir + "topology/core_id");
+        int package = package_text.empty() ? 0 : stoi(package_text);
+        int core = core_text.empty() ? cpu : stoi(core_text);
+
+        int llc_key = -1, best_level = -1;
+        for (int index = 0; index < 8; ++index) {
+            string level_text = read_sys_file(dir + "cache/index" + to_string(index) + "/level");
+            if (level_text.empty())
+                continue;
+            vector<int> shared_with =
+                parse_cpu_list(read_sys_file(dir + "cache/index" + to_string(index) + "/shared_cpu_list"));
+            if (stoi(level_text) > best_level && !shared_with.empty()) {
+                best_level = stoi(level_text);
+                llc_key = shared_with[0];
+            }
+        }
+        if (llc_key < 0)
+            llc_key = -1 - package;
+
+        Cpu_Info info;
+        info.cpu = cpu;
+        info.package = package_ids.emplace(package, package_ids.size()).first->second;
+        info.core = core_ids.emplace(make_pair(package, core), core_ids.size()).first->second;
+        info.llc = llc_ids.emplace(llc_key, llc_ids.size()).first->second;
+        cpus.push_back(info);
+    }
+    return cpus;
+}
+
+// read once, the topology doesn't change during a run
+const vector<Cpu_Info>& host_topology() {
+    static const vector<Cpu_Info> topology = read_cpu_topology();
+    return topology;
+}
+
+// the CPU thread i is pinned to, threads wrap around the online CPUs
+const Cpu_Info& cpu_for_thread(int thread_index) {
+    const vector<Cpu_Info>& cpus = host_topology();
+    return cpus[thread_index % cpus.size()];
+}
+
+// pins the calling thread to one CPU, quietly does nothing if not allowed
+void pin_thread(int thread_index) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu_for_thread(thread_index).cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+// one node of the counter tree, on its own cache line
+struct alignas(cache_line_size) Tree_Node {
+    atomic<long long> value{0};
+    // how many adds this node has taken, kept for the root to compare with flat
+    atomic<long long> updates{0};
+    long long threshold = 0;
+    int parent = -1;
+};
+
+// Hierarchical counter: a thread flushes into the node of the core it is
+// pinned to, a core node passes its value up to the LLC node once it holds
+// sloppiness * fanout, an LLC node to the socket node at sloppiness * fanout^2
+// and so on up to the global root. Most flushes then stay on a line that is
+// only shared inside one core or cache. read() adds up every node, so counts
+// held on the way up are never lost.
+struct Tree_Flush : Sim_Engine {
+    vector<Tree_Node> nodes;
+    vector<int> thread_leaf;
+    int core_nodes = 0, llc_nodes = 0, package_nodes = 0;
+
+    Tree_Flush(int n_threads, long long sloppiness, int fanout) {
+        const vector<Cpu_Info>& cpus = host_topology();
+        for (const Cpu_Info& c : cpus) {
+            core_nodes = max(core_nodes, c.core + 1);
+            llc_nodes = max(llc_nodes, c.llc + 1);
+            package_nodes = max(package_nodes, c.package + 1);
+        }
+        // layout: cores, then LLCs, then sockets, then the root
+        int llc_base = core_nodes, package_base = llc_base + llc_nodes;
+        int root = package_base + package_nodes;
+        nodes = vector<Tree_Node>(root + 1);
+
+        long long f = max(fanout, 1);
+        for (const Cpu_Info& c : cpus) {
+            nodes[c.core].parent = llc_base + c.llc;
+            nodes[llc_base + c.llc].parent = package_base + c.package;
+            nodes[package_base + c.package].parent = root;
+        }
+        for (int i = 0; i < core_nodes; ++i)
+            nodes[i].threshold = sloppiness * f;
+        for (int i = llc_base; i < package_base; ++i)
+            nodes[i].threshold = sloppiness * f * f;
+        for (int i = package_base; i < root; ++i)
+            nodes[i].threshold = sloppiness * f * f * f;
+
+        for (int t = 0; t < n_threads; ++t)
+            thread_leaf.push_back(cpu_for_thread(t).core);
+    }
+
+    bool flush(int thread_index, long long amount) override {
+        long long t0 = stats_enabled ? now_ns() : 0;
+        int node = thread_leaf[thread_index];
+        long long carry = amount;
+        while (carry != 0) {
+            Tree_Node& n = nodes[node];
+            long long now = n.value.fetch_add(carry, memory_order_relaxed) + carry;
+            if (n.parent < 0) {
+                n.updates.fetch_add(1, memory_order_relaxed);
+                break;
+            }
+            if (now < n.threshold)
+                break;
+            // take everything this node holds, other threads' adds included
+            carry = n.value.exchange(0, memory_order_relaxed);
+            node = n.parent;
+        }
+        if (stats_enabled)
+            record_flush(now_ns() - t0, 0);
+        return false;
+    }
+
+    long long read() override {
+        long long total = 0;
+        for (auto& n : nodes)
+            total += n.value.load(memory_order_relaxed);
+        return total;
+    }
+
+    long long root_updates() { return nodes.back().updates.load(memory_order_relaxed); }
+};
+
+// a thread's published bucket for flat combining
+struct alignas(cache_line_size) Publication {
+    atomic<long long> pending{0};
+};
+
+// Flat combining: a flushing thread publishes its bucket in its own record
+// and tries the lock. Whoever wins applies every published record in one go,
+// the others wait until their record has been picked up. Exact, and at low
+// sloppiness one lock hand off covers many threads' flushes.
+struct Flat_Combining_Flush : Sim_Engine {
+    atomic<long long> global_counter{0};
+    mutex combiner_lock;
+    vector<Publication> records;
+
+    explicit Flat_Combining_Flush(int n_threads) : records(n_threads) {}
+
+    bool flush(int thread_index, long long amount) override {
+        long long t0 = stats_enabled ? now_ns() : 0;
+        atomic<long long>& mine = records[thread_index].pending;
+        mine.fetch_add(amount, memory_order_release);
+        bool contended = false;
+        while (mine.load(memory_order_acquire) != 0) {
+            if (combiner_lock.try_lock()) {
+                long long t1 = stats_enabled ? now_ns() : 0;
+                combine();
+                long long t2 = stats_enabled ? now_ns() : 0;
+                combiner_lock.unlock();
+                if (stats_enabled)
+                    record_flush(t1 - t0, t2 - t1);
+                return contended;
+            }
+            // someone else is combining and will most likely take our record
+            contended = true;
+            this_thread::yield();
+        }
+        if (stats_enabled)
+            record_flush(now_ns() - t0, 0);
+        return contended;
+    }
+
+    // only called with combiner_lock held
+    void combine() {
+        long long sum = 0;
+        for (auto& r : records)
+            if (r.pending.load(memory_order_relaxed) != 0)
+                sum += r.pending.exchange(0, memory_order_acq_rel);
+        global_counter.store(global_counter.load(memory_order_relaxed) + sum, memory_order_relaxed);
+    }
+
+    long long read() override { return global_counter.load(memory_order_relaxed); }
+};
+
+// one node of the combining tree, on its own cache line
+struct alignas(cache_line_size) Combining_Node {
+    atomic<long long> pending{0};
+    atomic<bool> busy{false};
+};
+
+// Software combining tree: a binary tree with two threads per leaf. A thread
+// adds its bucket to its leaf and tries to take the node. If the node is
+// taken, the thread holding it will carry the amount up, so the thread just
+// leaves. The holder takes everything pending, climbs to the parent the same
+// way, and after letting go checks once more for amounts that arrived in the
+// meantime. Only the root holder writes the global counter. The flags and
+// pending adds are seq_cst so that last check can't miss a deposit.
+struct Combining_Tree_Flush : Sim_Engine {
+    atomic<long long> global_counter{0};
+    vector<Combining_Node> nodes;
+    int first_leaf = 0;
+
+    explicit Combining_Tree_Flush(int n_threads) {
+        int leaves = 1;
+        while (leaves * 2 < n_threads)
+            leaves *= 2;
+        first_leaf = leaves - 1;
+        nodes = vector<Combining_Node>(2 * leaves - 1);
+    }
+
+    bool flush(int thread_index, long long amount) override {
+        long long t0 = stats_enabled ? now_ns() : 0;
+        bool contended = false;
+        deposit(first_leaf + thread_index / 2, amount, contended);
+        if (stats_enabled)
+            record_flush(now_ns() - t0, 0);
+        return contended;
+    }
+
+    void deposit(int node, long long amount, bool& contended) {
+        Combining_Node& n = nodes[node];
+        n.pending.fetch_add(amount);
+        while (true) {
+            if (n.busy.exchange(true)) {
+                contended = true;
+                return;
+            }
+            long long carry = n.pending.exchange(0);
+            if (carry != 0) {
+                if (node == 0)
+                    global_counter.store(global_counter.load(memory_order_relaxed) + carry,
+                                         memory_order_relaxed);
+                else
+                    deposit((node - 1) / 2, carry, contended);
+            }
+            n.busy.store(false);
+            if (n.pending.load() == 0)
+                return;
+        }
+    }
+
+    long long read() override { return global_counter.load(memory_order_relaxed); }
+};
+
+// --processes with --strategy mutex: the process shared mutex in the segment
+// guards the shared counter, same as Mutex_Flush but across processes
+struct Shm_Mutex_Flush : Sim_Engine {
+    Shm_Counter_Segment* seg;
+
+    explicit Shm_Mutex_Flush(Shm_Counter_Segment* s) : seg(s) {}
+
+    bool flush(int, long long amount) override {
+        long long t0 = stats_enabled ? now_ns() : 0;
+        bool contended = !shm_counter_try_lock(seg);
+        if (contended)
+            shm_counter_lock(seg);
+        long long t1 = stats_enabled ? now_ns() : 0;
+        seg->total.store(seg->total.load(memory_order_relaxed) + amount, memory_order_relaxed);
+        seg->flushes.store(seg->flushes.load(memory_order_relaxed) + 1, memory_order_relaxed);
+        long long t2 = stats_enabled ? now_ns() : 0;
+        shm_counter_unlock(seg);
+        if (stats_enabled)
+            record_flush(t1 - t0, t2 - t1);
+        return contended;
+    }
+    long long read() override { return seg->total.load(memory_order_relaxed); }
 };
 
-// estimated CPU work time
-const long long ms_increment = 550000;
+// --processes with --strategy atomic: lock free adds on the shared counter
+struct Shm_Atomic_Flush : Sim_Engine {
+    Shm_Counter_Segment* seg;
 
+    explicit Shm_Atomic_Flush(Shm_Counter_Segment* s) : seg(s) {}
 
-void cpu_work(int work_time_ms) {
-    // makes a random duration for requested time
-    int time_ms = rand() % static_cast<int>(work_time_ms) + (work_time_ms / 2);
-    long long increments = static_cast<long long>(time_ms) * ms_increment;
-    // keeps the CPU busy
+    bool flush(int, long long amount) override {
+        long long t0 = stats_enabled ? now_ns() : 0;
+        long long old = seg->total.load(memory_order_relaxed);
+        bool contended = !seg->total.compare_exchange_strong(old, old + amount, memory_order_relaxed);
+        if (contended)
+            seg->total.fetch_add(amount, memory_order_relaxed);
+        seg->flushes.fetch_add(1, memory_order_relaxed);
+        if (stats_enabled)
+            record_flush(now_ns() - t0, 0);
+        return contended;
+    }
+    long long read() override { return seg->total.load(memory_order_relaxed); }
+};
+
+// the --lock choices for the mutex strategy, nullptr for unknown names
+unique_ptr<Sim_Engine> make_lock_engine(const string& lock) {
+    if (lock == "mutex")
+        return make_unique<Lock_Flush<mutex>>();
+    if (lock == "ttas")
+        return make_unique<Lock_Flush<TTAS_Lock>>();
+    if (lock == "ticket")
+        return make_unique<Lock_Flush<Ticket_Lock>>();
+    if (lock == "mcs")
+        return make_unique<Lock_Flush<MCS_Lock>>();
+    if (lock == "futex")
+        return make_unique<Lock_Flush<Futex_Lock>>();
+    return nullptr;
+}
+
+// makes the flush engine for --strategy, returns nullptr for unknown names
+unique_ptr<Sim_Engine> make_flush_engine(const string& strategy, int n_threads, long long sloppiness,
+                                         int fanout, const string& lock) {
+    if (strategy == "mutex")
+        return make_lock_engine(lock);
+    if (strategy == "atomic")
+        return make_unique<Atomic_Flush>();
+    if (strategy == "sharded")
+        return make_unique<Sharded_Flush>(n_threads);
+    if (strategy == "tree")
+        return make_unique<Tree_Flush>(n_threads, sloppiness, fanout);
+    if (strategy == "combining")
+        return make_unique<Flat_Combining_Flush>(n_threads);
+    if (strategy == "combining-tree")
+        return make_unique<Combining_Tree_Flush>(n_threads);
+    return nullptr;
+}
+
+// how one thread's adaptive threshold moved during the run
+struct Threshold_Report {
+    long long peak = 0;
+    long long final = 0;
+    long long raises = 0;
+    long long lowers = 0;
+};
+
+// one point on the timeline, flush rate is worked out from neighbouring samples
+struct Timeline_Sample {
+    long long time_ns;
+    long long global_count;
+    long long exact_count;
+    long long flushes;
+    double avg_threshold;
+};
+
+// Fixed size ring buffer of samples, allocated before the run so sampling
+// never allocates. Once full the oldest samples are overwritten.
+struct Timeline_Ring {
+    vector<Timeline_Sample> samples;
+    size_t next = 0;
+    bool wrapped = false;
+
+    explicit Timeline_Ring(size_t capacity) : samples(max<size_t>(capacity, 1)) {}
+
+    void push(const Timeline_Sample& sample) {
+        samples[next] = sample;
+        if (++next == samples.size()) {
+            next = 0;
+            wrapped = true;
+        }
+    }
+
+    // oldest first
+    vector<Timeline_Sample> in_order() const {
+        vector<Timeline_Sample> out;
+        if (wrapped)
+            out.insert(out.end(), samples.begin() + next, samples.end());
+        out.insert(out.end(), samples.begin(), samples.begin() + next);
+        return out;
+    }
+};
+
+// settings for a single run, the positional arguments plus --strategy
+struct Sim_Config {
+    int n_threads = 2;
+    int sloppiness = 10;
+    int work_time = 10;
+    int work_iterations = 100;
+    bool cpu_bound = false;
+    // what a worker does between counter updates: busy, sleep, stream, chase, io or mixed.
+    // busy and sleep are the original cpu_bound true / false
+    string workload = "sleep";
+    int stream_kb = 8192;
+    int working_set_kb = 8192;
+    int io_file_kb = 4096;
+    bool do_logging = false;
+    bool collect_stats = false;
+    // run the sampler even without logging so the timeline can be written to a file
+    bool sample_timeline = false;
+    int sample_interval_ms = 10;
+    int timeline_capacity = 65536;
+    string strategy = "mutex";
+    // lock used by the mutex strategy
+    string lock = "mutex";
+    // base seed, each thread mixes in its index so runs with the same seed repeat
+    uint64_t seed = 1;
+    // total error budget for adaptive thresholds, 0 keeps sloppiness fixed
+    long long adaptive_budget = 0;
+    // run n_threads logical workers on a fixed pool instead of one thread each
+    bool executor = false;
+    int pool_threads = 0;
+    // fork this many processes that each run n_threads threads, 0 runs in this process
+    int processes = 0;
+    string shm_name = shm_default_name;
+    // pin counting threads to CPUs, always on for the tree strategy
+    bool pin = false;
+    int fanout = 4;
+    // --keys: count into this many named counters instead of one, 0 is the single counter
+    int keys = 0;
+    string key_dist = "uniform";
+    double zipf_s = 1.0;
+    int shards = 64;
+    int key_table = 256;
+
+    // number of OS threads that do the counting, each one has its own bucket
+    int counting_threads() const { return executor ? pool_threads : n_threads; }
+};
+
+// All shared data that is used by threads
+struct Shared_Data : Sim_Config {
+    unique_ptr<Sim_Engine> engine;
+    // per thread buckets on top of the engine, one handle per counting thread
+    unique_ptr<SloppyCounter<long long>> counter;
+    // filled in when each thread ends if --stats is on
+    vector<Thread_Stats> thread_stats;
+    // filled in when each thread ends if --adaptive is on
+    vector<Threshold_Report> threshold_reports;
+    // threads wait here until all of them exist, so the early ones don't get a head start
+    atomic<int> threads_ready{0};
+    // every thread's flush count at the moment the first thread finished
+    atomic<bool> first_finished{false};
+    vector<long long> flushes_at_first_finish;
+};
+
+// what one run measured
+struct Run_Result {
+    double elapsed = 0;
+    long long final_count = 0;
+    long long flushes = 0;
+    // adds that landed on the one global cache line, every flush for flat engines
+    long long global_updates = 0;
+    // per thread flush counts when the first thread finished, shows starvation
+    vector<long long> flushes_at_first_finish;
+    vector<Thread_Stats> thread_stats;
+    vector<Threshold_Report> threshold_reports;
+    vector<Timeline_Sample> timeline;
+};
+
+// Each thread gets its own generator (splitmix64) so the workers don't
+// serialize on the global state behind rand().
+struct Work_Rng {
+    uint64_t state;
+
+    explicit Work_Rng(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+    // uniform in [0, n)
+    int below(int n) { return static_cast<int>(next() % static_cast<uint64_t>(n)); }
+};
+
+// loop iterations per ms of CPU work, measured on this machine by calibrate_cpu_work()
+long long ms_increment = 550000;
+
+// keeps the CPU busy, not inlined so calibration times exactly the same code
+__attribute__((noinline)) void spin(long long increments) {
     volatile long long dummy = 0;
     for (long long i = 0; i < increments; ++i)
         dummy += i;
 }
 
+// times the spin loop and sets ms_increment, the fastest of a few tries is
+// kept since anything slower was the thread getting interrupted
+void calibrate_cpu_work() {
+    long long increments = 100000;
+    // grow the loop until one run is long enough to time well
+    while (true) {
+        auto start = chrono::steady_clock::now();
+        spin(increments);
+        chrono::duration<double, milli> took = chrono::steady_clock::now() - start;
+        if (took.count() >= 20.0)
+            break;
+        increments *= 2;
+    }
+    double best_ms = 1e300;
+    for (int i = 0; i < 5; ++i) {
+        auto start = chrono::steady_clock::now();
+        spin(increments);
+        chrono::duration<double, milli> took = chrono::steady_clock::now() - start;
+        best_ms = min(best_ms, took.count());
+    }
+    ms_increment = max(1LL, static_cast<long long>(increments / best_ms));
+}
+
+// makes a random duration in [work_time / 2, work_time * 3 / 2) ms
+int random_work_ms(int work_time_ms, Work_Rng& rng) {
+    return rng.below(work_time_ms) + (work_time_ms / 2);
+}
+
+void cpu_work(int work_time_ms, Work_Rng& rng) {
+    if (work_time_ms <= 0)
+        return;
+    int time_ms = random_work_ms(work_time_ms, rng);
+    spin(static_cast<long long>(time_ms) * ms_increment);
+}
+
 // sleeps the thread for random amount of time
-void io_work(int work_time_ms) {
-    int time_ms = rand() % static_cast<int>(work_time_ms) + (work_time_ms / 2);
+void io_work(int work_time_ms, Work_Rng& rng) {
+    if (work_time_ms <= 0)
+        return;
+    int time_ms = random_work_ms(work_time_ms, rng);
     this_thread::sleep_for(chrono::milliseconds(time_ms));
 }
 
-// Each thread does work and increments a local_bucket
-// When the local_bucket gets to be > sloppiness, it sends
-// the count to the global counter and holds the mutex.
+// opens a counter for the calling thread only, -1 if the kernel does not allow it
+int open_perf_counter(uint32_t type, uint64_t config, bool user_only) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = user_only;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+}
+
+long long read_perf_counter(int fd) {
+    long long value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value))
+        return -1;
+    return value;
+}
+
+long long rusage_context_switches() {
+    rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) != 0)
+        return -1;
+    return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// perf counters for one thread, opened when the thread starts and read when it ends.
+// context switches fall back to getrusage when perf events are not allowed
+struct Perf_Counters {
+    int switch_fd = -1;
+    int miss_fd = -1;
+    long long rusage_start = 0;
+
+    void start() {
+        switch_fd = open_perf_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, false);
+        miss_fd = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, false);
+        if (miss_fd < 0)
+            miss_fd = open_perf_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true);
+        rusage_start = rusage_context_switches();
+    }
+
+    void stop(Thread_Stats& stats) {
+        stats.cache_misses = read_perf_counter(miss_fd);
+        stats.context_switches = read_perf_counter(switch_fd);
+        if (stats.context_switches >= 0) {
+            stats.switch_source = "perf";
+        } else if (rusage_start >= 0) {
+            stats.context_switches = rusage_context_switches() - rusage_start;
+            stats.switch_source = "rusage";
+        }
+        if (switch_fd >= 0)
+            close(switch_fd);
+        if (miss_fd >= 0)
+            close(miss_fd);
+    }
+};
+
+// start gate, returns once every counting thread has reached it
+void wait_for_start(Shared_Data* shared) {
+    int n = shared->counter->max_threads();
+    shared->threads_ready.fetch_add(1);
+    while (shared->threads_ready.load() < n)
+        this_thread::yield();
+}
+
+// The first thread to finish records how far every thread has got. Every
+// thread does the same number of flushes in the end, so this snapshot is
+// where an unfair lock shows up as threads that have fallen behind.
+void note_thread_finished(Shared_Data* shared) {
+    if (shared->first_finished.exchange(true))
+        return;
+    int n = shared->counter->max_threads();
+    shared->flushes_at_first_finish.resize(n);
+    for (int i = 0; i < n; ++i)
+        shared->flushes_at_first_finish[i] = shared->counter->flushes(i);
+}
+
+// saves where this thread's adaptive threshold ended up
+void save_threshold_report(const SloppyCounter<long long>::Handle& counter, Shared_Data* shared) {
+    if (shared->adaptive_budget <= 0)
+        return;
+    Threshold_Report& report = shared->threshold_reports[counter.index()];
+    report.peak = counter.peak_threshold();
+    report.final = counter.threshold();
+    report.raises = counter.raises();
+    report.lowers = counter.lowers();
+}
+
+// elements per stream chunk, a constant so the compiler can vectorize the loop
+// without a scalar tail
+const size_t stream_chunk = 16384;
+
+// triad over one chunk: a = a * 0.5 + b
+__attribute__((noinline)) void stream_kernel(float* __restrict a, const float* __restrict b) {
+    for (size_t i = 0; i < stream_chunk; ++i)
+        a[i] = a[i] * 0.5f + b[i];
+}
+
+const size_t io_block = 4096;
+
+// Per thread buffers and file descriptors for the --workload kernels. Set up
+// before the start gate so no thread is still allocating and faulting in pages
+// while the others already count. Every kernel runs for the same random
+// duration as busy and sleep do.
+struct Workload_State {
+    string kind;
+    vector<float> stream_a, stream_b;
+    size_t stream_pos = 0;
+    vector<uint32_t> chase_next;
+    uint32_t chase_pos = 0;
+    int file_fd = -1;
+    int pipe_fds[2] = {-1, -1};
+    int epoll_fd = -1;
+    long long file_blocks = 0;
+    vector<char> io_buffer;
+    // keeps the chase and stream results alive so the loops aren't optimized out
+    volatile float sink = 0;
+
+    Workload_State(const Sim_Config& config, Work_Rng& rng) : kind(config.workload) {
+        bool mixed = kind == "mixed";
+        if (kind == "stream" || mixed) {
+            size_t n = max<size_t>(1, static_cast<size_t>(config.stream_kb) * 1024 / 2 /
+                                      sizeof(float) / stream_chunk) * stream_chunk;
+            stream_a.assign(n, 1.0f);
+            stream_b.assign(n, 2.0f);
+        }
+        if (kind == "chase" || mixed) {
+            // Sattolo's shuffle gives one cycle through every slot, so the chase
+            // visits the whole working set in random order
+            size_t n = max<size_t>(2, static_cast<size_t>(config.working_set_kb) * 1024 / sizeof(uint32_t));
+            chase_next.resize(n);
+            for (size_t i = 0; i < n; ++i)
+                chase_next[i] = static_cast<uint32_t>(i);
+            for (size_t i = n - 1; i > 0; --i)
+                swap(chase_next[i], chase_next[rng.next() % i]);
+        }
+        if (kind == "io" || mixed)
+            setup_io(config);
+    }
+
+    ~Workload_State() {
+        for (int fd : {file_fd, pipe_fds[0], pipe_fds[1], epoll_fd})
+            if (fd >= 0)
+                close(fd);
+    }
+
+    Workload_State(const Workload_State&) = delete;
+    Workload_State& operator=(const Workload_State&) = delete;
+
+    // an unlinked temp file to pread from, and a pipe watched by epoll
+    void setup_io(const Sim_Config& config) {
+        io_buffer.assign(io_block, 'x');
+        char path[] = "/tmp/sloppySim.XXXXXX";
+        file_fd = mkstemp(path);
+        if (file_fd >= 0) {
+            unlink(path);
+            file_blocks = max(1, config.io_file_kb * 1024 / static_cast<int>(io_block));
+            for (long long b = 0; b < file_blocks; ++b)
+                if (pwrite(file_fd, io_buffer.data(), io_block, b * io_block) != static_cast<ssize_t>(io_block))
+                    break;
+        }
+        epoll_fd = epoll_create1(0);
+        if (pipe(pipe_fds) == 0 && epoll_fd >= 0) {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = pipe_fds[0];
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_fds[0], &ev);
+        }
+    }
+
+    // streams through the two buffers chunk by chunk until the deadline
+    void stream_until(chrono::steady_clock::time_point deadline) {
+        do {
+            stream_kernel(&stream_a[stream_pos], &stream_b[stream_pos]);
+            stream_pos += stream_chunk;
+            if (stream_pos >= stream_a.size())
+                stream_pos = 0;
+        } while (chrono::steady_clock::now() < deadline);
+        sink = stream_a[stream_pos];
+    }
+
+    // dependent loads through the shuffled cycle, almost every one a cache miss
+    void chase_until(chrono::steady_clock::time_point deadline) {
+        uint32_t pos = chase_pos;
+        do {
+            for (int i = 0; i < 1024; ++i)
+                pos = chase_next[pos];
+        } while (chrono::steady_clock::now() < deadline);
+        chase_pos = pos;
+        sink = static_cast<float>(pos);
+    }
+
+    // pread a random block of the file, push it through the pipe and read it
+    // back once epoll says it is there
+    void io_until(chrono::steady_clock::time_point deadline, Work_Rng& rng) {
+        do {
+            if (file_fd >= 0) {
+                off_t offset = static_cast<off_t>(rng.next() % file_blocks) * io_block;
+                if (pread(file_fd, io_buffer.data(), io_block, offset) < 0)
+                    break;
+            }
+            if (pipe_fds[1] < 0 || epoll_fd < 0)
+                break;
+            if (write(pipe_fds[1], io_buffer.data(), io_block) < 0)
+                break;
+            epoll_event ev;
+            if (epoll_wait(epoll_fd, &ev, 1, -1) == 1 && read(pipe_fds[0], io_buffer.data(), io_block) < 0)
+                break;
+        } while (chrono::steady_clock::now() < deadline);
+    }
+
+    void run(int work_time_ms, Work_Rng& rng) {
+        if (work_time_ms <= 0)
+            return;
+        string k = kind;
+        if (k == "mixed") {
+            static const char* const kinds[] = {"busy", "stream", "chase", "io"};
+            k = kinds[rng.below(4)];
+        }
+        if (k == "busy") {
+            cpu_work(work_time_ms, rng);
+            return;
+        }
+        if (k == "sleep") {
+            io_work(work_time_ms, rng);
+            return;
+        }
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(random_work_ms(work_time_ms, rng));
+        if (k == "stream")
+            stream_until(deadline);
+        else if (k == "chase")
+            chase_until(deadline);
+        else
+            io_until(deadline, rng);
+    }
+};
+
+// Each thread does work and adds to its bucket in the counter.
+// When the bucket gets to sloppiness, the counter sends
+// the count to the flush engine picked with --strategy.
 void thread_func(int thread_index, Shared_Data* shared) {
-    long long local_bucket = 0;
+    SloppyCounter<long long>::Handle counter = shared->counter->handle(thread_index);
+    if (shared->pin)
+        pin_thread(thread_index);
+    Work_Rng rng(shared->seed + 0x632be59bd9b4e019ULL * (thread_index + 1));
+    Workload_State work(*shared, rng);
+    Perf_Counters perf;
+    if (stats_enabled) {
+        tls_stats = Thread_Stats();
+        perf.start();
+    }
+    wait_for_start(shared);
     for (int i = 0; i < shared->work_iterations; ++i) {
-        if(shared->cpu_bound)
-            cpu_work(shared->work_time);
-        else
-            io_work(shared->work_time);
-        
-        // increment local_bucket after work
-        local_bucket++;
+        long long work_start = stats_enabled ? now_ns() : 0;
+        work.run(shared->work_time, rng);
+        if (stats_enabled)
+            tls_stats.work_ns += now_ns() - work_start;
 
-        // when the bucket fills up, send to global counter
-        if (local_bucket >= shared->sloppiness) {
-            lock_guard<mutex> lock(shared->global_mutex);
-            shared->global_counter += local_bucket;
-            local_bucket = 0;
-        }
+        // count the work, flushes to the engine when the bucket fills up
+        counter.add(1);
     }
     // anything leftover also gets sent to global counter
-    if (local_bucket > 0)
-        lock_guard<mutex> lock(shared->global_mutex);
-        shared->global_counter += local_bucket;
+    counter.flush();
+    note_thread_finished(shared);
+    save_threshold_report(counter, shared);
+    if (stats_enabled) {
+        tls_stats.flushes = counter.flushes();
+        perf.stop(tls_stats);
+        shared->thread_stats[thread_index] = tls_stats;
+    }
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        cerr << "Usage: ./sloppySim <N_Threads> <Sloppiness> <work_time> <work_iterations> <cpu_bound> <do_logging>\n";
-        return 1;
+// one logical worker in executor mode is just its remaining iterations,
+// the timer queue remembers when it should run next
+struct Timer_Entry {
+    long long wake_ns;
+    int worker;
+    bool operator>(const Timer_Entry& other) const { return wake_ns > other.wake_ns; }
+};
+
+// Executor pool thread. Logical workers pool_index, pool_index + pool_size, ...
+// belong to this thread. Instead of blocking in io_work, a worker's I/O wait is
+// a timer queue entry, and the thread only sleeps until the earliest one is due.
+// Finished work goes into this pool thread's bucket, same as thread_func.
+void executor_func(int pool_index, Shared_Data* shared) {
+    int pool_size = shared->pool_threads;
+    SloppyCounter<long long>::Handle counter = shared->counter->handle(pool_index);
+    if (shared->pin)
+        pin_thread(pool_index);
+    Work_Rng rng(shared->seed + 0x632be59bd9b4e019ULL * (pool_index + 1));
+    // sleeping workers wait on the timer queue, every other workload runs inline
+    bool timer_sleep = shared->workload == "sleep";
+    Workload_State work(*shared, rng);
+    Perf_Counters perf;
+    if (stats_enabled) {
+        tls_stats = Thread_Stats();
+        perf.start();
     }
 
-    // arguments with default values
-    int N_Threads = (argc > 1) ? stoi(argv[1]) : 2;
-    int sloppiness = (argc > 2) ? stoi(argv[2]) : 10;
-    int work_time = (argc > 3) ? stoi(argv[3]) : 10;
-    int work_iterations = (argc > 4) ? stoi(argv[4]) : 100;
-    bool cpu_bound = (argc > 5) ? (strcmp(argv[5], "true") == 0) : false;
-    bool do_logging = (argc > 6) ? (strcmp(argv[6], "true") == 0) : false;
+    // the workers this thread owns and how many iterations each has left
+    int n_workers = (shared->n_threads - pool_index + pool_size - 1) / pool_size;
+    vector<int> remaining(max(n_workers, 0), shared->work_iterations);
+    vector<Timer_Entry> storage;
+    storage.reserve(remaining.size());
+    priority_queue<Timer_Entry, vector<Timer_Entry>, greater<Timer_Entry>> timers(
+        greater<Timer_Entry>(), move(storage));
 
-    Shared_Data shared;
-    shared.sloppiness = sloppiness;
-    shared.work_time = work_time;
-    shared.work_iterations = work_iterations;
-    shared.cpu_bound = cpu_bound;
-    shared.do_logging = do_logging;
-    shared.local_buckets.resize(N_Threads, 0);
+    // sleep work is a wait on the timer queue, any other workload is ready right away
+    auto schedule = [&](int worker, long long now) {
+        long long delay_ms = 0;
+        if (timer_sleep && shared->work_time > 0)
+            delay_ms = random_work_ms(shared->work_time, rng);
+        timers.push({now + delay_ms * 1000000, worker});
+    };
 
-    // print out each argument if logging is enabled
-    if (do_logging) {
-        cout << "Threads: " << N_Threads << "\n";
-        cout << "Sloppiness: " << sloppiness << "\n";
-        cout << "Work time: " << work_time << " ms\n";
-        cout << "Work iterations: " << work_iterations << "\n";
-        cout << "CPU bound: " << (cpu_bound ? "true" : "false") << "\n";
-        cout << "Logging: " << (do_logging ? "true" : "false") << "\n";
+    wait_for_start(shared);
+    long long start = now_ns();
+    if (shared->work_iterations > 0)
+        for (int w = 0; w < static_cast<int>(remaining.size()); ++w)
+            schedule(w, start);
+
+    while (!timers.empty()) {
+        Timer_Entry next = timers.top();
+        long long now = now_ns();
+        if (next.wake_ns > now) {
+            long long wait_start = now;
+            this_thread::sleep_for(chrono::nanoseconds(next.wake_ns - now));
+            now = now_ns();
+            if (stats_enabled)
+                tls_stats.work_ns += now - wait_start;
+        }
+        timers.pop();
+
+        if (!timer_sleep) {
+            long long work_start = stats_enabled ? now_ns() : 0;
+            work.run(shared->work_time, rng);
+            if (stats_enabled)
+                tls_stats.work_ns += now_ns() - work_start;
+            now = now_ns();
+        }
+
+        // the worker finished one iteration
+        counter.add(1);
+        if (--remaining[next.worker] > 0)
+            schedule(next.worker, now);
+    }
+
+    counter.flush();
+    note_thread_finished(shared);
+    save_threshold_report(counter, shared);
+    if (stats_enabled) {
+        tls_stats.flushes = counter.flushes();
+        perf.stop(tls_stats);
+        shared->thread_stats[pool_index] = tls_stats;
+    }
+}
+
+// Samples the counter every interval into a ring buffer until stop() is
+// called, which wakes it right away so it never outlives the workers.
+struct Timeline_Sampler {
+    Timeline_Ring ring;
+    SloppyCounter<long long>* counter;
+    chrono::milliseconds interval;
+    chrono::steady_clock::time_point start;
+    mutex stop_mutex;
+    condition_variable stop_cv;
+    bool stopping = false;
+    thread worker;
+
+    Timeline_Sampler(SloppyCounter<long long>* c, int interval_ms, size_t capacity)
+        : ring(capacity), counter(c), interval(max(1, interval_ms)) {}
+
+    void take_sample() {
+        long long approx = counter->read_approx();
+        long long exact = counter->read_exact();
+        ring.push({chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(),
+                   approx, exact, counter->flushes(), counter->average_threshold()});
+    }
+
+    void run() {
+        auto next = start;
+        unique_lock<mutex> lock(stop_mutex);
+        while (true) {
+            next += interval;
+            if (stop_cv.wait_until(lock, next, [this] { return stopping; }))
+                break;
+            take_sample();
+        }
+        // one last sample with the final counts
+        take_sample();
+    }
+
+    void begin(chrono::steady_clock::time_point run_start) {
+        start = run_start;
+        worker = thread(&Timeline_Sampler::run, this);
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(stop_mutex);
+            stopping = true;
+        }
+        stop_cv.notify_one();
+        worker.join();
     }
+};
+
+// starts the threads, samples while they run and joins them.
+// external_engine replaces the --strategy engine, e.g. one in shared memory.
+// elapsed comes back as -1 if the strategy is unknown
+Run_Result run_simulation(const Sim_Config& config, Sim_Engine* external_engine = nullptr) {
+    Run_Result result;
+    Shared_Data shared;
+    static_cast<Sim_Config&>(shared) = config;
+    int counting_threads = config.counting_threads();
+    if (!external_engine)
+        shared.engine = make_flush_engine(config.strategy, counting_threads, config.sloppiness,
+                                          config.fanout, config.lock);
+    Sim_Engine* engine = external_engine ? external_engine : shared.engine.get();
+    if (config.strategy == "tree")
+        shared.pin = true;
+    if (!engine) {
+        result.elapsed = -1;
+        return result;
+    }
+    shared.counter = make_unique<SloppyCounter<long long>>(counting_threads, config.sloppiness, engine);
+    // the budget is for all threads together, each thread gets an equal share
+    if (config.adaptive_budget > 0) {
+        shared.counter->set_adaptive(config.adaptive_budget / counting_threads);
+        shared.threshold_reports.assign(counting_threads, Threshold_Report());
+    }
+    stats_enabled = config.collect_stats;
+    if (stats_enabled)
+        shared.thread_stats.assign(counting_threads, Thread_Stats());
 
     auto start = chrono::high_resolution_clock::now();
 
+    unique_ptr<Timeline_Sampler> sampler;
+    if (config.do_logging || config.sample_timeline) {
+        sampler = make_unique<Timeline_Sampler>(shared.counter.get(), config.sample_interval_ms,
+                                                config.timeline_capacity);
+        sampler->begin(chrono::steady_clock::now());
+    }
+
     // threads
     vector<thread> threads;
-    for (int i = 0; i < N_Threads; ++i) {
-        threads.emplace_back(thread_func, i, &shared);
+    for (int i = 0; i < counting_threads; ++i) {
+        if (config.executor)
+            threads.emplace_back(executor_func, i, &shared);
+        else
+            threads.emplace_back(thread_func, i, &shared);
     }
-    // display global counters value if logging is enabled
-    if (do_logging) {
-        int log = max(1, work_time * work_iterations / 10);
-        for (int i = 0; i < log; ++i) {
-            this_thread::sleep_for(chrono::milliseconds(10));
-            cout << "Log time=" << i *10 << "ms, Global time= " << shared.global_counter.load() << endl;
+    // when all threads are finished, join them
+    for (auto& t : threads)
+        t.join();
+
+    auto end = chrono::high_resolution_clock::now();
+    if (sampler) {
+        sampler->stop();
+        result.timeline = sampler->ring.in_order();
+    }
+    chrono::duration<double> duration = end - start;
+
+    result.elapsed = duration.count();
+    result.final_count = shared.counter->read_approx();
+    result.flushes = shared.counter->flushes();
+    result.flushes_at_first_finish = move(shared.flushes_at_first_finish);
+    if (auto* tree = dynamic_cast<Tree_Flush*>(engine))
+        result.global_updates = tree->root_updates();
+    else
+        result.global_updates = result.flushes;
+    result.thread_stats = move(shared.thread_stats);
+    result.threshold_reports = move(shared.threshold_reports);
+    return result;
+}
+
+// Jain's fairness index, 1 when every thread got the same share and 1/n
+// when one thread got everything
+double jain_index(const vector<long long>& shares) {
+    double sum = 0, sum_sq = 0;
+    for (long long x : shares) {
+        sum += x;
+        sum_sq += static_cast<double>(x) * x;
+    }
+    return sum_sq > 0 ? sum * sum / (shares.size() * sum_sq) : 1.0;
+}
+
+// spread of the per thread flush counts from when the first thread finished
+void print_fairness_report(const Run_Result& result, const Sim_Config& config) {
+    const vector<long long>& shares = result.flushes_at_first_finish;
+    if (shares.empty())
+        return;
+    long long lo = *min_element(shares.begin(), shares.end());
+    long long hi = *max_element(shares.begin(), shares.end());
+    double mean = 0;
+    for (long long x : shares)
+        mean += x;
+    mean /= shares.size();
+    double var = 0;
+    for (long long x : shares)
+        var += (x - mean) * (x - mean);
+    double stddev = sqrt(var / shares.size());
+
+    cout << "\nFairness (" << (config.strategy == "mutex" ? config.lock + " lock" : config.strategy)
+         << "), flushes per thread when the first thread finished:\n";
+    cout << fixed << setprecision(3) << "  min " << lo << ", max " << hi << ", mean " << mean
+         << ", stddev " << stddev << ", cv " << (mean > 0 ? stddev / mean : 0.0)
+         << ", Jain index " << jain_index(shares) << "\n";
+    cout << "  throughput " << setprecision(0) << result.final_count / max(result.elapsed, 1e-9)
+         << " updates/s, " << result.flushes / max(result.elapsed, 1e-9) << " flushes/s\n"
+         << defaultfloat;
+}
+
+// flushes per second between a sample and the one before it
+double flush_rate(const vector<Timeline_Sample>& timeline, size_t i) {
+    if (i == 0)
+        return 0;
+    double dt = (timeline[i].time_ns - timeline[i - 1].time_ns) / 1e9;
+    return dt > 0 ? (timeline[i].flushes - timeline[i - 1].flushes) / dt : 0;
+}
+
+// the log lines for do_logging, printed after the run so printing doesn't slow the workers
+void print_timeline(const vector<Timeline_Sample>& timeline, long long error_bound, bool adaptive) {
+    string out;
+    for (size_t i = 0; i < timeline.size(); ++i) {
+        const Timeline_Sample& s = timeline[i];
+        ostringstream line;
+        line << "Log time=" << s.time_ns / 1000000 << "ms, Global time= " << s.global_count
+             << ", exact= " << s.exact_count << ", staleness= " << s.exact_count - s.global_count
+             << " (bound " << error_bound << "), flush rate= " << fixed << setprecision(0)
+             << flush_rate(timeline, i) << "/s";
+        if (adaptive)
+            line << ", avg threshold= " << setprecision(2) << s.avg_threshold;
+        out += line.str() + "\n";
+    }
+    cout << out;
+}
+
+// writes the timeline as CSV, or as raw records if the file name ends in .bin:
+// the 8 bytes "SLOPTL1\0", a uint64 sample count, then per sample the int64s
+// time_ns, global, exact, flushes and the double flush rate
+bool write_timeline(const vector<Timeline_Sample>& timeline, const string& path) {
+    bool binary = path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+    ofstream file(path, binary ? ios::binary : ios::out);
+    if (!file)
+        return false;
+    if (binary) {
+        file.write("SLOPTL1", 8);
+        uint64_t count = timeline.size();
+        file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+        for (size_t i = 0; i < timeline.size(); ++i) {
+            const Timeline_Sample& s = timeline[i];
+            int64_t fields[4] = {s.time_ns, s.global_count, s.exact_count, s.flushes};
+            double rate = flush_rate(timeline, i);
+            file.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+            file.write(reinterpret_cast<const char*>(&rate), sizeof(rate));
+        }
+    } else {
+        file << "time_ms,global_count,exact_count,flushes,flush_rate\n" << fixed;
+        for (size_t i = 0; i < timeline.size(); ++i) {
+            const Timeline_Sample& s = timeline[i];
+            file << setprecision(3) << s.time_ns / 1e6 << ',' << s.global_count << ','
+                 << s.exact_count << ',' << s.flushes << ',' << setprecision(0)
+                 << flush_rate(timeline, i) << '\n';
         }
     }
-    // when all threads are finished, join them
+    return static_cast<bool>(file);
+}
+
+// Runs the same settings again on the flat atomic counter, pinned the same
+// way, and prints both. Global line updates are adds that landed on the one
+// counter every thread shares, so the gap is the cross socket traffic saved.
+void print_tree_comparison(const Sim_Config& config, const Run_Result& tree) {
+    Sim_Config flat_config = config;
+    flat_config.strategy = "atomic";
+    flat_config.pin = true;
+    flat_config.do_logging = false;
+    flat_config.sample_timeline = false;
+    flat_config.collect_stats = false;
+    flat_config.adaptive_budget = 0;
+    Run_Result flat = run_simulation(flat_config);
+
+    int cores = 0, llcs = 0, packages = 0;
+    for (const Cpu_Info& c : host_topology()) {
+        cores = max(cores, c.core + 1);
+        llcs = max(llcs, c.llc + 1);
+        packages = max(packages, c.package + 1);
+    }
+    cout << "\nTopology: " << host_topology().size() << " cpus, " << cores << " cores, " << llcs
+         << " LLCs, " << packages << " sockets, fan-out " << config.fanout << "\n";
+    cout << setw(8) << "design" << setw(14) << "elapsed s" << setw(12) << "flushes"
+         << setw(16) << "global updates" << setw(10) << "count\n";
+    cout << setw(8) << "tree" << setw(14) << tree.elapsed << setw(12) << tree.flushes
+         << setw(16) << tree.global_updates << setw(9) << tree.final_count << "\n";
+    cout << setw(8) << "flat" << setw(14) << flat.elapsed << setw(12) << flat.flushes
+         << setw(16) << flat.global_updates << setw(9) << flat.final_count << "\n";
+    if (tree.global_updates > 0)
+        cout << "Global line updates saved: " << fixed << setprecision(1)
+             << static_cast<double>(flat.global_updates) / tree.global_updates << "x fewer\n"
+             << defaultfloat;
+}
+
+// --processes: forks the writer processes, each runs n_threads threads that
+// flush into the counter in a POSIX shared memory segment, then runs the same
+// total number of threads in this process so the two flush paths can be compared.
+// sloppyReader can attach to the segment while this runs.
+int run_processes(const Sim_Config& config) {
+    if (config.strategy != "mutex" && config.strategy != "atomic") {
+        cerr << "--processes supports --strategy mutex or atomic\n";
+        return 1;
+    }
+    Shm_Counter_Segment* seg = shm_counter_create(config.shm_name);
+    if (!seg) {
+        cerr << "Could not create shared memory " << config.shm_name << ": " << strerror(errno) << "\n";
+        return 1;
+    }
+    seg->processes = config.processes;
+    seg->threads_per_process = config.counting_threads();
+    seg->sloppiness = config.sloppiness;
+    strncpy(seg->strategy, config.strategy.c_str(), sizeof(seg->strategy) - 1);
+    seg->start_ns = now_ns();
+    seg->running.store(config.processes);
+
+    // children only count, the parent does all the printing
+    Sim_Config child_config = config;
+    child_config.do_logging = false;
+    child_config.sample_timeline = false;
+    child_config.collect_stats = false;
+
+    auto start = chrono::high_resolution_clock::now();
+    vector<pid_t> children;
+    for (int p = 0; p < config.processes; ++p) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            cerr << "fork failed: " << strerror(errno) << "\n";
+            break;
+        }
+        if (pid == 0) {
+            child_config.seed = config.seed + 0x9e3779b97f4a7c15ULL * (p + 1);
+            unique_ptr<Sim_Engine> engine;
+            if (config.strategy == "mutex")
+                engine = make_unique<Shm_Mutex_Flush>(seg);
+            else
+                engine = make_unique<Shm_Atomic_Flush>(seg);
+            run_simulation(child_config, engine.get());
+            seg->running.fetch_sub(1, memory_order_release);
+            _exit(0);
+        }
+        children.push_back(pid);
+    }
+    // anything not forked will never run, don't let the reader wait for it
+    seg->running.fetch_sub(config.processes - static_cast<int>(children.size()));
+
+    bool failed = children.size() != static_cast<size_t>(config.processes);
+    for (pid_t pid : children) {
+        int status = 0;
+        waitpid(pid, &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed = true;
+    }
+    auto end = chrono::high_resolution_clock::now();
+    seg->done.store(1, memory_order_release);
+    chrono::duration<double> duration = end - start;
+    long long final_count = seg->total.load();
+    long long flushes = seg->flushes.load();
+
+    cout << "\nFinal Global count: " << final_count << endl;
+    cout << "Elasped time: " << duration.count() << " seconds" << endl;
+
+    // same number of threads and strategy, all in one process
+    Sim_Config local_config = child_config;
+    local_config.n_threads = config.counting_threads() * config.processes;
+    local_config.pool_threads = local_config.executor ? local_config.n_threads : 0;
+    local_config.executor = false;
+    Run_Result local = run_simulation(local_config);
+
+    cout << "\n" << setw(22) << "path" << setw(14) << "elapsed s" << setw(12) << "flushes"
+         << setw(14) << "ns per flush" << setw(10) << "count\n";
+    cout << setw(22) << (to_string(config.processes) + " processes (shm)") << setw(14)
+         << duration.count() << setw(12) << flushes << setw(14) << fixed << setprecision(1)
+         << (flushes > 0 ? duration.count() * 1e9 / flushes : 0.0) << setw(9) << final_count
+         << "\n" << defaultfloat;
+    cout << setw(22) << "1 process" << setw(14) << setprecision(6) << local.elapsed << setw(12) << local.flushes
+         << setw(14) << fixed << setprecision(1)
+         << (local.flushes > 0 ? local.elapsed * 1e9 / local.flushes : 0.0) << setw(9)
+         << local.final_count << "\n" << defaultfloat;
+
+    munmap(seg, sizeof(Shm_Counter_Segment));
+    shm_unlink(config.shm_name.c_str());
+    if (failed) {
+        cerr << "A writer process did not finish cleanly\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Picks which key an update goes to. Uniform, or Zipf where key k (from 0)
+// gets weight 1 / (k + 1)^s; the Zipf CDF is built once and shared by all threads.
+struct Key_Sampler {
+    int keys;
+    vector<double> cdf;
+
+    Key_Sampler(int n_keys, const string& dist, double s) : keys(n_keys) {
+        if (dist != "zipf")
+            return;
+        cdf.resize(keys);
+        double total = 0;
+        for (int k = 0; k < keys; ++k) {
+            total += 1.0 / pow(k + 1.0, s);
+            cdf[k] = total;
+        }
+        for (double& c : cdf)
+            c /= total;
+    }
+
+    uint64_t next(Work_Rng& rng) const {
+        if (cdf.empty())
+            return static_cast<uint64_t>(rng.below(keys));
+        double u = static_cast<double>(rng.next() >> 11) * 0x1.0p-53;
+        size_t k = upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin();
+        return min<size_t>(k, keys - 1);
+    }
+};
+
+using Keyed_Counter = KeyedSloppyCounter<uint64_t, long long>;
+
+// --keys worker, same loop as thread_func but every iteration counts into one
+// key picked by the sampler
+void keyed_thread_func(int thread_index, const Sim_Config* config, Keyed_Counter* counter,
+                       const Key_Sampler* sampler, atomic<int>* ready, long long* flushes) {
+    Keyed_Counter::Handle handle = counter->handle();
+    if (config->pin)
+        pin_thread(thread_index);
+    Work_Rng rng(config->seed + 0x632be59bd9b4e019ULL * (thread_index + 1));
+    Workload_State work(*config, rng);
+    ready->fetch_add(1);
+    while (ready->load() < config->n_threads)
+        this_thread::yield();
+    for (int i = 0; i < config->work_iterations; ++i) {
+        work.run(config->work_time, rng);
+        handle.add(sampler->next(rng));
+    }
+    handle.flush();
+    *flushes = handle.flushes();
+}
+
+// --keys: runs the workers against a KeyedSloppyCounter and reports update
+// throughput, how well batching saved shard locks and what each key costs in memory
+int run_keyed(const Sim_Config& config) {
+    if (config.keys < 1 || config.shards < 1 || config.key_table < 4) {
+        cerr << "--keys must be at least 1, --shards at least 1 and --key-table at least 4\n";
+        return 1;
+    }
+    if (config.key_dist != "uniform" && config.key_dist != "zipf") {
+        cerr << "Unknown key distribution: " << config.key_dist << " (expected uniform or zipf)\n";
+        return 1;
+    }
+    Key_Sampler sampler(config.keys, config.key_dist, config.zipf_s);
+    Keyed_Counter counter(config.n_threads, config.sloppiness, config.shards, config.key_table);
+    atomic<int> ready{0};
+    vector<long long> flushes(config.n_threads, 0);
+
+    auto start = chrono::high_resolution_clock::now();
+    vector<thread> threads;
+    for (int i = 0; i < config.n_threads; ++i)
+        threads.emplace_back(keyed_thread_func, i, &config, &counter, &sampler, &ready, &flushes[i]);
     for (auto& t : threads)
         t.join();
-    
     auto end = chrono::high_resolution_clock::now();
     chrono::duration<double> duration = end - start;
 
-    cout << "\nFinal Global count: " << shared.global_counter.load() << endl;
+    long long updates = static_cast<long long>(config.n_threads) * config.work_iterations;
+    long long batches = 0;
+    for (long long f : flushes)
+        batches += f;
+    size_t keys_touched = counter.keys();
+    size_t map_bytes = counter.map_bytes();
+    uint64_t hottest = 0;
+    long long hottest_count = 0;
+    counter.for_each([&](uint64_t key, long long count) {
+        if (count > hottest_count) {
+            hottest = key;
+            hottest_count = count;
+        }
+    });
+
+    cout << "\nFinal Global count: " << counter.total() << endl;
     cout << "Elasped time: " << duration.count() << " seconds" << endl;
+    cout << "\nKeyed counter (" << config.keys << " keys, " << config.key_dist;
+    if (config.key_dist == "zipf")
+        cout << " s=" << config.zipf_s;
+    cout << ", " << counter.shards() << " shards, " << counter.table_size() << " slot delta tables)\n";
+    cout << "  updates/s:           " << fixed << setprecision(0)
+         << (duration.count() > 0 ? updates / duration.count() : 0.0) << "\n" << defaultfloat;
+    cout << "  keys touched:        " << keys_touched << "\n";
+    cout << "  hottest key:         " << hottest << " (" << fixed << setprecision(1)
+         << (updates > 0 ? 100.0 * hottest_count / updates : 0.0) << "% of updates)\n";
+    cout << "  batches:             " << batches << ", " << setprecision(1)
+         << (batches > 0 ? static_cast<double>(counter.flushed_keys()) / batches : 0.0)
+         << " keys and " << (batches > 0 ? static_cast<double>(counter.shard_locks()) / batches : 0.0)
+         << " shard locks per batch\n";
+    cout << "  updates per lock:    "
+         << (counter.shard_locks() > 0 ? static_cast<double>(updates) / counter.shard_locks() : 0.0) << "\n";
+    cout << "  map memory:          " << map_bytes / 1024 << " KB, "
+         << (keys_touched > 0 ? static_cast<double>(map_bytes) / keys_touched : 0.0) << " bytes per key\n";
+    cout << "  delta tables:        " << counter.table_bytes() / 1024 << " KB for "
+         << config.n_threads << " threads\n" << defaultfloat << setprecision(6);
+    cout << "  error bound per key: " << counter.error_bound() << "\n";
+    return 0;
+}
+
+// where each thread's threshold peaked and ended, and how often it moved
+void print_threshold_report(const vector<Threshold_Report>& reports, const Sim_Config& config) {
+    int n = static_cast<int>(reports.size());
+    long long per_thread_max = max<long long>(config.sloppiness, config.adaptive_budget / max(n, 1));
+    cout << "\nAdaptive thresholds (start " << config.sloppiness << ", max " << per_thread_max
+         << " per thread, error budget " << per_thread_max * n << ")\n";
+    cout << setw(8) << "thread" << setw(10) << "peak" << setw(10) << "final"
+         << setw(10) << "raises" << setw(10) << "lowers" << "\n";
+    long long raises = 0, lowers = 0;
+    double final_sum = 0;
+    for (int i = 0; i < n; ++i) {
+        const Threshold_Report& r = reports[i];
+        cout << setw(8) << i << setw(10) << r.peak << setw(10) << r.final
+             << setw(10) << r.raises << setw(10) << r.lowers << "\n";
+        raises += r.raises;
+        lowers += r.lowers;
+        final_sum += r.final;
+    }
+    cout << "Total raises: " << raises << ", lowers: " << lowers
+         << ", average final threshold: " << (n > 0 ? final_sum / n : 0.0) << "\n";
+}
+
+// prints -1 counters as n/a
+string counter_text(long long value) {
+    return value < 0 ? "n/a" : to_string(value);
+}
+
+// per thread table then the totals and the merged wait histogram
+void print_stats_report(const vector<Thread_Stats>& stats) {
+    Thread_Stats total;
+    total.context_switches = 0;
+    total.cache_misses = 0;
+    cout << "\nContention report (times in ms)\n";
+    cout << setw(8) << "thread" << setw(10) << "flushes" << setw(12) << "wait" << setw(12) << "hold"
+         << setw(12) << "work" << setw(10) << "wait %" << setw(12) << "ctx sw" << setw(14) << "cache miss\n";
+    cout << fixed << setprecision(3);
+    for (size_t i = 0; i < stats.size(); ++i) {
+        const Thread_Stats& s = stats[i];
+        double busy = static_cast<double>(s.wait_ns + s.hold_ns + s.work_ns);
+        cout << setw(8) << i << setw(10) << s.flushes << setw(12) << s.wait_ns / 1e6
+             << setw(12) << s.hold_ns / 1e6 << setw(12) << s.work_ns / 1e6
+             << setw(10) << (busy > 0 ? 100.0 * s.wait_ns / busy : 0.0)
+             << setw(12) << counter_text(s.context_switches)
+             << setw(13) << counter_text(s.cache_misses) << "\n";
+
+        total.flushes += s.flushes;
+        total.wait_ns += s.wait_ns;
+        total.hold_ns += s.hold_ns;
+        total.work_ns += s.work_ns;
+        for (int b = 0; b < wait_histogram_buckets; ++b)
+            total.wait_histogram[b] += s.wait_histogram[b];
+        total.context_switches = (total.context_switches < 0 || s.context_switches < 0)
+                                     ? -1 : total.context_switches + s.context_switches;
+        total.cache_misses = (total.cache_misses < 0 || s.cache_misses < 0)
+                                 ? -1 : total.cache_misses + s.cache_misses;
+    }
+    double busy = static_cast<double>(total.wait_ns + total.hold_ns + total.work_ns);
+    cout << setw(8) << "all" << setw(10) << total.flushes << setw(12) << total.wait_ns / 1e6
+         << setw(12) << total.hold_ns / 1e6 << setw(12) << total.work_ns / 1e6
+         << setw(10) << (busy > 0 ? 100.0 * total.wait_ns / busy : 0.0)
+         << setw(12) << counter_text(total.context_switches)
+         << setw(13) << counter_text(total.cache_misses) << "\n";
+    if (!stats.empty())
+        cout << "Context switches from: " << stats[0].switch_source << "\n";
+    if (total.flushes > 0)
+        cout << "Average wait per flush: " << total.wait_ns / static_cast<double>(total.flushes)
+             << " ns, hold: " << total.hold_ns / static_cast<double>(total.flushes) << " ns\n";
+
+    cout << "Wait histogram:\n";
+    for (int b = 0; b < wait_histogram_buckets; ++b) {
+        if (total.wait_histogram[b] == 0)
+            continue;
+        long long lo = (b == 0) ? 0 : (1LL << b);
+        cout << "  [" << setw(12) << lo << ", " << setw(12) << (1LL << (b + 1)) << ") ns: "
+             << total.wait_histogram[b] << "\n";
+    }
+    cout << defaultfloat;
+}
+
+// parses a sweep range: "4" , "1,2,8" , "lo:hi" , "lo:hi:step" or "lo:hi:xF" to multiply by F
+vector<int> parse_range(const string& text) {
+    vector<int> values;
+    if (text.find(':') == string::npos) {
+        stringstream ss(text);
+        string item;
+        while (getline(ss, item, ','))
+            values.push_back(stoi(item));
+        return values;
+    }
+    stringstream ss(text);
+    string lo_s, hi_s, step_s;
+    getline(ss, lo_s, ':');
+    getline(ss, hi_s, ':');
+    getline(ss, step_s);
+    int lo = stoi(lo_s), hi = stoi(hi_s);
+    bool geometric = !step_s.empty() && step_s[0] == 'x';
+    int step = step_s.empty() ? 1 : stoi(geometric ? step_s.substr(1) : step_s);
+    if (step < (geometric ? 2 : 1))
+        throw invalid_argument("bad step in range " + text);
+    for (int v = lo; v <= hi; v = geometric ? v * step : v + step) {
+        values.push_back(v);
+        if (geometric && v == 0)
+            break;
+    }
+    return values;
+}
+
+// nearest rank percentile of already sorted values
+double percentile(const vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(p / 100.0 * sorted.size() + 0.999999);
+    rank = min(max<size_t>(rank, 1), sorted.size());
+    return sorted[rank - 1];
+}
+
+// runs every combination of the sweep ranges, each point gets warmup runs
+// that are thrown away and then trials that are summarized in one CSV row
+int run_sweep(const Sim_Config& base, map<string, string>& options) {
+    auto range_or = [&](const string& name, int fallback) {
+        return options.count(name) ? parse_range(options[name]) : vector<int>{fallback};
+    };
+    vector<int> thread_values = range_or("threads", base.n_threads);
+    vector<int> sloppiness_values = range_or("sloppiness", base.sloppiness);
+    vector<int> work_time_values = range_or("work-time", base.work_time);
+    vector<int> iteration_values = range_or("iterations", base.work_iterations);
+    auto list_or = [&](const string& name, const string& fallback) {
+        vector<string> values;
+        stringstream ss(options.count(name) ? options[name] : fallback);
+        string item;
+        while (getline(ss, item, ','))
+            values.push_back(item);
+        return values;
+    };
+    vector<string> strategies = list_or("strategy", base.strategy);
+    vector<string> locks = list_or("lock", base.lock);
+    int trials = options.count("trials") ? stoi(options["trials"]) : 5;
+    int warmup = options.count("warmup") ? stoi(options["warmup"]) : 1;
+    if (trials < 1) {
+        cerr << "--trials must be at least 1\n";
+        return 1;
+    }
+
+    ofstream file;
+    if (options.count("csv")) {
+        file.open(options["csv"]);
+        if (!file) {
+            cerr << "Could not open " << options["csv"] << "\n";
+            return 1;
+        }
+    }
+    ostream& out = file.is_open() ? file : cout;
+    out << "strategy,threads,sloppiness,work_time,iterations,cpu_bound,trials,"
+           "mean_s,median_s,p95_s,flushes_per_s,updates_per_s,lock,jain_fairness,workload\n";
+
+    for (const string& strategy : strategies)
+    for (const string& lock : locks)
+    for (int n_threads : thread_values)
+    for (int sloppiness : sloppiness_values)
+    for (int work_time : work_time_values)
+    for (int iterations : iteration_values) {
+        // the lock only matters to the mutex strategy
+        if (strategy != "mutex" && lock != locks.front())
+            continue;
+        Sim_Config config = base;
+        config.strategy = strategy;
+        config.lock = lock;
+        config.n_threads = n_threads;
+        config.sloppiness = sloppiness;
+        config.work_time = work_time;
+        config.work_iterations = iterations;
+        config.do_logging = false;
+        config.sample_timeline = false;
+        config.collect_stats = false;
 
+        for (int i = 0; i < warmup; ++i)
+            run_simulation(config);
+
+        vector<double> times;
+        double flush_rate = 0, update_rate = 0, fairness = 0;
+        for (int i = 0; i < trials; ++i) {
+            Run_Result r = run_simulation(config);
+            if (r.elapsed < 0) {
+                cerr << "Unknown strategy or lock: " << strategy << ", " << lock << "\n";
+                return 1;
+            }
+            fairness += jain_index(r.flushes_at_first_finish);
+            times.push_back(r.elapsed);
+            // guard against a run too short for the clock to see
+            double t = max(r.elapsed, 1e-9);
+            flush_rate += r.flushes / t;
+            update_rate += r.final_count / t;
+        }
+        sort(times.begin(), times.end());
+        double mean = 0;
+        for (double t : times)
+            mean += t;
+        mean /= trials;
+
+        out << strategy << ',' << n_threads << ',' << sloppiness << ',' << work_time << ','
+            << iterations << ',' << (config.cpu_bound ? "true" : "false") << ',' << trials << ','
+            << setprecision(6) << mean << ',' << percentile(times, 50) << ','
+            << percentile(times, 95) << ',' << fixed << setprecision(0)
+            << flush_rate / trials << ',' << update_rate / trials << ',' << lock << ','
+            << setprecision(4) << fairness / trials << ',' << config.workload << '\n' << defaultfloat;
+        out.flush();
+    }
     return 0;
-}
\ No newline at end of file
+}
+
+// options that are switches and never take a value
+const set<string> flag_options = {"sweep", "stats", "executor", "pin"};
+
+// splits the command line into positional arguments and --name value options,
+// --name=value also works
+void parse_args(int argc, char* argv[], vector<string>& positional, map<string, string>& options) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            positional.push_back(arg);
+            continue;
+        }
+        size_t eq = arg.find('=');
+        if (eq != string::npos)
+            options[arg.substr(2, eq - 2)] = arg.substr(eq + 1);
+        else if (flag_options.count(arg.substr(2)))
+            options[arg.substr(2)] = "true";
+        else if (i + 1 < argc)
+            options[arg.substr(2)] = argv[++i];
+        else
+            options[arg.substr(2)] = "";
+    }
+}
+
+int main(int argc, char* argv[]) {
+    vector<string> args;
+    map<string, string> options;
+    parse_args(argc, argv, args, options);
+    bool sweep = options.count("sweep") > 0;
+
+    if (args.empty() && !sweep) {
+        cerr << "Usage: ./sloppySim <N_Threads> <Sloppiness> <work_time> <work_iterations> <cpu_bound> <do_logging>"
+                " [--strategy mutex|atomic|sharded] [--lock mutex|ttas|ticket|mcs|futex] [--stats] [--seed N] [--executor [--pool N]]"
+                " [--strategy tree [--fanout F]] [--pin] [--processes N [--shm-name /name]]"
+                " [--adaptive BUDGET] [--timeline file.csv|file.bin] [--sample-ms N] [--samples N]"
+                " [--workload busy|sleep|stream|chase|io|mixed [--stream-kb N] [--working-set-kb N] [--io-file-kb N]]"
+                " [--keys N [--key-dist uniform|zipf] [--zipf S] [--shards N] [--key-table N]]\n"
+                "       ./sloppySim [positional defaults] --sweep [--threads R] [--sloppiness R] [--work-time R]"
+                " [--iterations R] [--strategy a,b] [--trials N] [--warmup N] [--csv file]\n";
+        return 1;
+    }
+
+    // arguments with default values
+    Sim_Config config;
+    config.n_threads = (args.size() > 0) ? stoi(args[0]) : 2;
+    config.sloppiness = (args.size() > 1) ? stoi(args[1]) : 10;
+    config.work_time = (args.size() > 2) ? stoi(args[2]) : 10;
+    config.work_iterations = (args.size() > 3) ? stoi(args[3]) : 100;
+    config.cpu_bound = (args.size() > 4) ? (args[4] == "true") : false;
+    config.do_logging = (args.size() > 5) ? (args[5] == "true") : false;
+    config.strategy = options.count("strategy") ? options["strategy"] : "mutex";
+    config.lock = options.count("lock") ? options["lock"] : "mutex";
+    config.collect_stats = options.count("stats") > 0;
+    config.workload = options.count("workload") ? options["workload"] : (config.cpu_bound ? "busy" : "sleep");
+    static const set<string> workloads = {"busy", "sleep", "stream", "chase", "io", "mixed"};
+    if (!workloads.count(config.workload)) {
+        cerr << "Unknown workload: " << config.workload << " (expected busy, sleep, stream, chase, io or mixed)\n";
+        return 1;
+    }
+    if (options.count("stream-kb"))
+        config.stream_kb = stoi(options["stream-kb"]);
+    if (options.count("working-set-kb"))
+        config.working_set_kb = stoi(options["working-set-kb"]);
+    if (options.count("io-file-kb"))
+        config.io_file_kb = stoi(options["io-file-kb"]);
+
+    config.seed = options.count("seed") ? stoull(options["seed"]) : random_device{}();
+    config.sample_timeline = options.count("timeline") > 0;
+    if (options.count("sample-ms"))
+        config.sample_interval_ms = stoi(options["sample-ms"]);
+    if (options.count("samples"))
+        config.timeline_capacity = stoi(options["samples"]);
+    config.executor = options.count("executor") > 0;
+    if (options.count("processes"))
+        config.processes = stoi(options["processes"]);
+    if (options.count("shm-name"))
+        config.shm_name = options["shm-name"];
+    config.pin = options.count("pin") > 0;
+    if (options.count("fanout"))
+        config.fanout = stoi(options["fanout"]);
+    if (options.count("keys"))
+        config.keys = stoi(options["keys"]);
+    if (options.count("key-dist"))
+        config.key_dist = options["key-dist"];
+    if (options.count("zipf"))
+        config.zipf_s = stod(options["zipf"]);
+    if (options.count("shards"))
+        config.shards = stoi(options["shards"]);
+    if (options.count("key-table"))
+        config.key_table = stoi(options["key-table"]);
+    if (options.count("adaptive"))
+        config.adaptive_budget = stoll(options["adaptive"]);
+    if (options.count("pool"))
+        config.pool_threads = stoi(options["pool"]);
+    else
+        config.pool_threads = static_cast<int>(max(1u, thread::hardware_concurrency()));
+    if (config.pool_threads < 1) {
+        cerr << "--pool must be at least 1\n";
+        return 1;
+    }
+
+    // busy work needs the calibration, the sweep can change work_time so always do it there
+    bool busy = config.workload == "busy" || config.workload == "mixed";
+    if ((busy && config.work_time > 0) || sweep)
+        calibrate_cpu_work();
+
+    if (sweep)
+        return run_sweep(config, options);
+    if (config.processes > 0)
+        return run_processes(config);
+    if (config.keys > 0) {
+        if (config.executor) {
+            cerr << "--keys runs one thread per worker, it can't be used with --executor\n";
+            return 1;
+        }
+        return run_keyed(config);
+    }
+
+    if (!make_lock_engine(config.lock)) {
+        cerr << "Unknown lock: " << config.lock << " (expected mutex, ttas, ticket, mcs or futex)\n";
+        return 1;
+    }
+    if (!make_flush_engine(config.strategy, 1, config.sloppiness, config.fanout, config.lock)) {
+        cerr << "Unknown strategy: " << config.strategy << " (expected mutex, atomic, sharded, tree, combining or combining-tree)\n";
+        return 1;
+    }
+
+    // print out each argument if logging is enabled
+    if (config.do_logging) {
+        cout << "Threads: " << config.n_threads << "\n";
+        cout << "Strategy: " << config.strategy << "\n";
+        cout << "Sloppiness: " << config.sloppiness << "\n";
+        cout << "Work time: " << config.work_time << " ms\n";
+        cout << "Work iterations: " << config.work_iterations << "\n";
+        cout << "CPU bound: " << (config.cpu_bound ? "true" : "false") << "\n";
+        cout << "Logging: " << (config.do_logging ? "true" : "false") << "\n";
+        cout << "Seed: " << config.seed << "\n";
+        if (config.executor)
+            cout << "Executor: " << config.n_threads << " logical workers on "
+                 << config.pool_threads << " pool threads\n";
+        cout << "Workload: " << config.workload << "\n";
+        if (busy)
+            cout << "Calibrated CPU work: " << ms_increment << " iterations/ms\n";
+    }
+
+    Run_Result result = run_simulation(config);
+
+    if (config.do_logging) {
+        int threads = config.counting_threads();
+        long long per_thread = config.adaptive_budget > 0
+                                   ? max<long long>(config.sloppiness, config.adaptive_budget / threads)
+                                   : config.sloppiness;
+        print_timeline(result.timeline, per_thread * threads, config.adaptive_budget > 0);
+    }
+    if (config.sample_timeline && !write_timeline(result.timeline, options["timeline"])) {
+        cerr << "Could not write " << options["timeline"] << "\n";
+        return 1;
+    }
+
+    cout << "\nFinal Global count: " << result.final_count << endl;
+    cout << "Elasped time: " << result.elapsed << " seconds" << endl;
+    if (config.executor) {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        cout << "Pool threads: " << config.pool_threads << ", peak RSS: " << usage.ru_maxrss << " KB" << endl;
+    }
+    if (config.collect_stats)
+        print_stats_report(result.thread_stats);
+    if (config.adaptive_budget > 0)
+        print_threshold_report(result.threshold_reports, config);
+    if (options.count("lock") || config.collect_stats)
+        print_fairness_report(result, config);
+    if (config.strategy == "tree")
+        print_tree_comparison(config, result);
+
+    return 0;
+}
@@ -0,0 +1,208 @@
+// Caleb Bright
+// SloppyCounter<T>: a header only approximate counter.
+//
+// Every thread adds into its own bucket and only pushes the bucket to the
+// shared total (the flush engine) once it reaches the sloppiness. Reads come
+// in two kinds:
+//   read_approx() only reads the flushed total, it is cheap but can be behind.
+//   read_exact()  also adds up every thread's unflushed bucket.
+//
+// Error bound: after add() a bucket always holds less than sloppiness (in
+// absolute value), so with N threads read_approx() is never more than
+// N * sloppiness away from the true count. error_bound() returns that number.
+// read_exact() is exact once the writers stop; while they run it can miss or
+// double count a bucket that is being flushed at that exact moment, which is
+// still inside the same bound.
+//
+// Adaptive mode (set_adaptive): each thread starts at sloppiness, doubles its
+// own threshold when a flush hits contention and slowly lowers it back when
+// flushes go through uncontended. It never goes past max_sloppiness, so the
+// bound becomes N * max_sloppiness.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// size of one cache line, per thread data is padded to this so threads don't false share
+const size_t cache_line_size = 64;
+
+// Where a thread's bucket goes when it flushes. Each engine decides how the
+// flushed counts are stored and how they are read back.
+template <typename T>
+struct Flush_Engine {
+    virtual ~Flush_Engine() = default;
+    // returns true if the flush ran into contention (lock already held, lost a CAS),
+    // engines that can't tell return false
+    virtual bool flush(int thread_index, T amount) = 0;
+    // total of everything flushed so far
+    virtual T read() = 0;
+};
+
+// default engine, one atomic add on a shared total per flush. It tries a
+// single CAS first so a lost race can be reported as contention.
+template <typename T>
+struct Atomic_Flush_Engine : Flush_Engine<T> {
+    std::atomic<T> total{0};
+
+    bool flush(int, T amount) override {
+        T old = total.load(std::memory_order_relaxed);
+        if (total.compare_exchange_strong(old, old + amount, std::memory_order_relaxed))
+            return false;
+        total.fetch_add(amount, std::memory_order_relaxed);
+        return true;
+    }
+    T read() override { return total.load(std::memory_order_relaxed); }
+};
+
+template <typename T>
+class SloppyCounter {
+    // what a thread publishes so readers can see its unflushed bucket,
+    // only the owning thread ever writes it
+    struct alignas(cache_line_size) Slot {
+        std::atomic<T> bucket{0};
+        std::atomic<long long> flushes{0};
+        // the thread's current flush threshold, only changes in adaptive mode
+        std::atomic<T> threshold{0};
+    };
+
+public:
+    // A thread's view of the counter. Get one with handle(i) and only use it
+    // from one thread; i must be unique per thread and below max_threads.
+    class Handle {
+    public:
+        Handle(SloppyCounter* counter, int index)
+            : counter_(counter), index_(index), slot_(&counter->slots_[index]),
+              threshold_(counter->sloppiness_), peak_threshold_(counter->sloppiness_) {}
+
+        void add(T delta = 1) {
+            bucket_ += delta;
+            if (bucket_ >= threshold_ || bucket_ <= -threshold_)
+                flush();
+            else
+                slot_->bucket.store(bucket_, std::memory_order_relaxed);
+        }
+
+        // pushes whatever is in the bucket to the engine, call before the thread exits
+        void flush() {
+            if (bucket_ == 0)
+                return;
+            bool contended = counter_->engine_->flush(index_, bucket_);
+            bucket_ = 0;
+            slot_->bucket.store(0, std::memory_order_relaxed);
+            slot_->flushes.store(slot_->flushes.load(std::memory_order_relaxed) + 1,
+                                 std::memory_order_relaxed);
+            if (counter_->adaptive_)
+                adapt(contended);
+        }
+
+        T unflushed() const { return bucket_; }
+        long long flushes() const { return slot_->flushes.load(std::memory_order_relaxed); }
+        int index() const { return index_; }
+
+        // adaptive mode history for this thread
+        T threshold() const { return threshold_; }
+        T peak_threshold() const { return peak_threshold_; }
+        long long raises() const { return raises_; }
+        long long lowers() const { return lowers_; }
+
+    private:
+        // double on contention, back off by an eighth when the flush was free
+        void adapt(bool contended) {
+            T old = threshold_;
+            if (contended)
+                threshold_ = std::min<T>(threshold_ * 2, counter_->max_sloppiness_);
+            else
+                threshold_ = std::max<T>(counter_->sloppiness_,
+                                         threshold_ - std::max<T>(1, threshold_ / 8));
+            if (threshold_ == old)
+                return;
+            if (threshold_ > old)
+                raises_++;
+            else
+                lowers_++;
+            peak_threshold_ = std::max(peak_threshold_, threshold_);
+            slot_->threshold.store(threshold_, std::memory_order_relaxed);
+        }
+
+        SloppyCounter* counter_;
+        int index_;
+        Slot* slot_;
+        T bucket_ = 0;
+        T threshold_;
+        T peak_threshold_;
+        long long raises_ = 0;
+        long long lowers_ = 0;
+    };
+
+    // engine can be nullptr to use a plain atomic total, the counter does not own it
+    SloppyCounter(int max_threads, T sloppiness, Flush_Engine<T>* engine = nullptr)
+        : sloppiness_(sloppiness), max_sloppiness_(sloppiness), slots_(max_threads) {
+        for (Slot& s : slots_)
+            s.threshold.store(sloppiness, std::memory_order_relaxed);
+        if (!engine) {
+            own_engine_.reset(new Atomic_Flush_Engine<T>());
+            engine = own_engine_.get();
+        }
+        engine_ = engine;
+    }
+
+    SloppyCounter(const SloppyCounter&) = delete;
+    SloppyCounter& operator=(const SloppyCounter&) = delete;
+
+    // turns on adaptive thresholds, call before any handle is made.
+    // max_sloppiness is raised to sloppiness if it is smaller
+    void set_adaptive(T max_sloppiness) {
+        adaptive_ = true;
+        max_sloppiness_ = std::max(max_sloppiness, sloppiness_);
+    }
+
+    Handle handle(int thread_index) { return Handle(this, thread_index); }
+
+    // flushed total only
+    T read_approx() const { return engine_->read(); }
+
+    // flushed total plus every thread's unflushed bucket
+    T read_exact() const {
+        T total = engine_->read();
+        for (const Slot& s : slots_)
+            total += s.bucket.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    // worst case distance between read_approx() and the true count
+    T error_bound() const { return static_cast<T>(slots_.size()) * max_sloppiness_; }
+
+    // mean of the threads' current thresholds, the sloppiness unless adaptive
+    double average_threshold() const {
+        double total = 0;
+        for (const Slot& s : slots_)
+            total += static_cast<double>(s.threshold.load(std::memory_order_relaxed));
+        return slots_.empty() ? 0.0 : total / slots_.size();
+    }
+
+    // flushes done by all threads so far
+    long long flushes() const {
+        long long total = 0;
+        for (const Slot& s : slots_)
+            total += s.flushes.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    long long flushes(int thread_index) const {
+        return slots_[thread_index].flushes.load(std::memory_order_relaxed);
+    }
+
+    int max_threads() const { return static_cast<int>(slots_.size()); }
+    T sloppiness() const { return sloppiness_; }
+    T max_sloppiness() const { return max_sloppiness_; }
+    bool adaptive() const { return adaptive_; }
+
+private:
+    T sloppiness_;
+    T max_sloppiness_;
+    bool adaptive_ = false;
+    std::vector<Slot> slots_;
+    Flush_Engine<T>* engine_;
+    std::unique_ptr<Flush_Engine<T>> own_engine_;
+};
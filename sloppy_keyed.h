@@ -0,0 +1,221 @@
+// Caleb Bright
+// KeyedSloppyCounter<Key, T>: many named sloppy counters, one per key.
+//
+// Each thread buffers per key deltas in a small open addressing table in its
+// Handle. Once the deltas in the table add up to sloppiness (in absolute
+// value), or the table is three quarters full, the whole table is flushed as
+// one batch into a sharded global map. A batch is sorted by shard first so
+// each shard's lock is taken once per batch, not once per key.
+//
+// Error bound: a thread never holds more than sloppiness unflushed counts
+// over all of its keys together, so read_approx(key) is never more than
+// max_threads * sloppiness away from the true count for that key, the same
+// bound as SloppyCounter.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "sloppy_counter.h"
+
+// std::hash is the identity for integers on libstdc++, which puts runs of
+// neighbouring keys in the same shard and the same probe chain, so it is mixed
+inline uint64_t mix_key_hash(uint64_t h) {
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+template <typename Key>
+struct Mixed_Hash {
+    size_t operator()(const Key& key) const { return mix_key_hash(std::hash<Key>()(key)); }
+};
+
+template <typename Key, typename T, typename Hash = Mixed_Hash<Key>>
+class KeyedSloppyCounter {
+    // one part of the global map with its own lock, padded so the shard
+    // locks don't false share
+    struct alignas(cache_line_size) Shard {
+        std::mutex lock;
+        std::unordered_map<Key, T, Hash> counts;
+    };
+
+    // one slot of a thread's delta table
+    struct Entry {
+        Key key{};
+        T delta = 0;
+        bool used = false;
+    };
+
+public:
+    // A thread's delta table. Get one with handle() and only use it from one
+    // thread; call flush() before the thread exits.
+    class Handle {
+    public:
+        explicit Handle(KeyedSloppyCounter* counter)
+            : counter_(counter), table_(counter->table_size_), mask_(counter->table_size_ - 1),
+              max_used_(counter->table_size_ * 3 / 4) {}
+
+        void add(const Key& key, T delta = 1) {
+            size_t i = counter_->hash_(key) & mask_;
+            while (table_[i].used && !(table_[i].key == key))
+                i = (i + 1) & mask_;
+            Entry& e = table_[i];
+            if (!e.used) {
+                e.used = true;
+                e.key = key;
+                used_++;
+            }
+            e.delta += delta;
+            pending_ += delta < 0 ? -delta : delta;
+            if (pending_ >= counter_->sloppiness_ || used_ >= max_used_)
+                flush();
+        }
+
+        // sends every buffered delta to the global map and empties the table
+        void flush() {
+            if (used_ == 0)
+                return;
+            batch_.clear();
+            for (Entry& e : table_)
+                if (e.used && e.delta != 0)
+                    batch_.push_back({counter_->shard_of(e.key), &e});
+            std::sort(batch_.begin(), batch_.end(),
+                      [](const Batch_Item& a, const Batch_Item& b) { return a.shard < b.shard; });
+            size_t i = 0;
+            long long shard_locks = 0;
+            while (i < batch_.size()) {
+                size_t shard = batch_[i].shard;
+                Shard& s = counter_->shards_[shard];
+                std::lock_guard<std::mutex> guard(s.lock);
+                shard_locks++;
+                for (; i < batch_.size() && batch_[i].shard == shard; ++i)
+                    s.counts[batch_[i].entry->key] += batch_[i].entry->delta;
+            }
+            for (Entry& e : table_)
+                e = Entry();
+            counter_->flushed_keys_.fetch_add(static_cast<long long>(batch_.size()), std::memory_order_relaxed);
+            counter_->shard_locks_.fetch_add(shard_locks, std::memory_order_relaxed);
+            flushes_++;
+            used_ = 0;
+            pending_ = 0;
+        }
+
+        long long flushes() const { return flushes_; }
+
+    private:
+        struct Batch_Item {
+            size_t shard;
+            Entry* entry;
+        };
+
+        KeyedSloppyCounter* counter_;
+        std::vector<Entry> table_;
+        std::vector<Batch_Item> batch_;
+        size_t mask_;
+        size_t max_used_;
+        size_t used_ = 0;
+        T pending_ = 0;
+        long long flushes_ = 0;
+    };
+
+    // shards and table_size are rounded up to powers of two
+    KeyedSloppyCounter(int max_threads, T sloppiness, size_t shards = 64, size_t table_size = 256)
+        : max_threads_(max_threads), sloppiness_(std::max<T>(1, sloppiness)),
+          table_size_(round_up_pow2(std::max<size_t>(table_size, 4))),
+          shards_(round_up_pow2(std::max<size_t>(shards, 1))) {}
+
+    KeyedSloppyCounter(const KeyedSloppyCounter&) = delete;
+    KeyedSloppyCounter& operator=(const KeyedSloppyCounter&) = delete;
+
+    Handle handle() { return Handle(this); }
+
+    // flushed count for one key
+    T read_approx(const Key& key) {
+        Shard& s = shards_[shard_of(key)];
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto it = s.counts.find(key);
+        return it == s.counts.end() ? 0 : it->second;
+    }
+
+    // flushed total over every key
+    T total() {
+        T sum = 0;
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            for (const auto& kv : s.counts)
+                sum += kv.second;
+        }
+        return sum;
+    }
+
+    // calls f(key, count) for every key in the global map, one shard locked at a time
+    template <typename F>
+    void for_each(F f) {
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            for (const auto& kv : s.counts)
+                f(kv.first, kv.second);
+        }
+    }
+
+    size_t keys() {
+        size_t n = 0;
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            n += s.counts.size();
+        }
+        return n;
+    }
+
+    // Rough bytes held by the global map: the shards, their bucket arrays and
+    // one node per key (next pointer, cached hash, key and count). The
+    // allocator's own overhead per node is not included.
+    size_t map_bytes() {
+        size_t node = sizeof(void*) + sizeof(size_t) + sizeof(std::pair<const Key, T>);
+        size_t bytes = shards_.size() * sizeof(Shard);
+        for (Shard& s : shards_) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            bytes += s.counts.bucket_count() * sizeof(void*) + s.counts.size() * node;
+        }
+        return bytes;
+    }
+
+    // bytes of every thread's delta table, fixed no matter how many keys there are
+    size_t table_bytes() const { return static_cast<size_t>(max_threads_) * table_size_ * sizeof(Entry); }
+
+    // worst case distance between read_approx(key) and the true count
+    T error_bound() const { return static_cast<T>(max_threads_) * sloppiness_; }
+
+    // key deltas sent to the map, and shard locks taken to send them
+    long long flushed_keys() const { return flushed_keys_.load(std::memory_order_relaxed); }
+    long long shard_locks() const { return shard_locks_.load(std::memory_order_relaxed); }
+
+    size_t shards() const { return shards_.size(); }
+    size_t table_size() const { return table_size_; }
+    T sloppiness() const { return sloppiness_; }
+
+private:
+    static size_t round_up_pow2(size_t n) {
+        size_t p = 1;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+
+    // the table uses the low bits of the hash, the shards use the high ones so
+    // a batch's keys aren't all in one shard
+    size_t shard_of(const Key& key) const { return (hash_(key) >> 40) & (shards_.size() - 1); }
+
+    int max_threads_;
+    T sloppiness_;
+    size_t table_size_;
+    Hash hash_;
+    std::vector<Shard> shards_;
+    std::atomic<long long> flushed_keys_{0};
+    std::atomic<long long> shard_locks_{0};
+};
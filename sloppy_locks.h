@@ -0,0 +1,181 @@
+// Caleb Bright
+// Lock implementations for the flush critical section, picked with --lock.
+// They all have lock(), try_lock() and unlock() so they drop into
+// std::lock_guard or a template the same way std::mutex does.
+//
+// The pure spinning locks (ttas, ticket, mcs) yield the CPU every
+// spin_yield_interval spins, otherwise a waiter can burn its whole time slice
+// while the holder is descheduled when there are more threads than cores.
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+const int spin_yield_interval = 1024;
+
+// tells the CPU we are in a spin loop
+inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// counts spins and yields the thread once in a while
+struct Spin_Wait {
+    int spins = 0;
+
+    void once() {
+        cpu_relax();
+        if (++spins % spin_yield_interval == 0)
+            std::this_thread::yield();
+    }
+};
+
+// test-and-test-and-set: spins reading the flag so waiters share the cache
+// line, and backs off exponentially after each failed grab
+class TTAS_Lock {
+public:
+    void lock() {
+        int backoff = 1;
+        Spin_Wait wait;
+        while (true) {
+            while (locked_.load(std::memory_order_relaxed))
+                wait.once();
+            if (!locked_.exchange(true, std::memory_order_acquire))
+                return;
+            for (int i = 0; i < backoff; ++i)
+                wait.once();
+            backoff = std::min(backoff * 2, max_backoff);
+        }
+    }
+    bool try_lock() {
+        return !locked_.load(std::memory_order_relaxed) &&
+               !locked_.exchange(true, std::memory_order_acquire);
+    }
+    void unlock() { locked_.store(false, std::memory_order_release); }
+
+private:
+    static const int max_backoff = 1024;
+    std::atomic<bool> locked_{false};
+};
+
+// FIFO ticket lock, every thread takes a number and waits for it to be served
+class Ticket_Lock {
+public:
+    void lock() {
+        unsigned my_ticket = next_.fetch_add(1, std::memory_order_relaxed);
+        Spin_Wait wait;
+        while (serving_.load(std::memory_order_acquire) != my_ticket)
+            wait.once();
+    }
+    bool try_lock() {
+        unsigned serving = serving_.load(std::memory_order_acquire);
+        unsigned expected = serving;
+        return next_.compare_exchange_strong(expected, serving + 1, std::memory_order_acquire,
+                                             std::memory_order_relaxed);
+    }
+    void unlock() {
+        serving_.store(serving_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    alignas(64) std::atomic<unsigned> next_{0};
+    alignas(64) std::atomic<unsigned> serving_{0};
+};
+
+// MCS queue lock: waiters form a linked list and each one spins on its own
+// node, so a hand off only touches the next waiter's cache line. A thread
+// only ever holds one MCS lock here, so its node can live in thread local storage.
+class MCS_Lock {
+    struct alignas(64) Node {
+        std::atomic<Node*> next{nullptr};
+        std::atomic<bool> waiting{false};
+    };
+
+    static Node& my_node() {
+        static thread_local Node node;
+        return node;
+    }
+
+public:
+    void lock() {
+        Node& me = my_node();
+        me.next.store(nullptr, std::memory_order_relaxed);
+        me.waiting.store(true, std::memory_order_relaxed);
+        Node* prev = tail_.exchange(&me, std::memory_order_acq_rel);
+        if (!prev)
+            return;
+        prev->next.store(&me, std::memory_order_release);
+        Spin_Wait wait;
+        while (me.waiting.load(std::memory_order_acquire))
+            wait.once();
+    }
+    bool try_lock() {
+        Node& me = my_node();
+        me.next.store(nullptr, std::memory_order_relaxed);
+        Node* expected = nullptr;
+        return tail_.compare_exchange_strong(expected, &me, std::memory_order_acquire,
+                                             std::memory_order_relaxed);
+    }
+    void unlock() {
+        Node& me = my_node();
+        Node* next = me.next.load(std::memory_order_acquire);
+        if (!next) {
+            Node* expected = &me;
+            if (tail_.compare_exchange_strong(expected, nullptr, std::memory_order_release,
+                                              std::memory_order_relaxed))
+                return;
+            // someone swapped in behind us but hasn't linked yet
+            Spin_Wait wait;
+            while (!(next = me.next.load(std::memory_order_acquire)))
+                wait.once();
+        }
+        next->waiting.store(false, std::memory_order_release);
+    }
+
+private:
+    std::atomic<Node*> tail_{nullptr};
+};
+
+// Spins for a while and then sleeps in the kernel with futex. State is
+// 0 = free, 1 = locked, 2 = locked and someone may be sleeping, so unlock
+// only makes the wake syscall when it has to.
+class Futex_Lock {
+public:
+    void lock() {
+        for (int i = 0; i < spin_limit; ++i) {
+            if (try_lock())
+                return;
+            cpu_relax();
+        }
+        int state = state_.exchange(2, std::memory_order_acquire);
+        while (state != 0) {
+            futex(FUTEX_WAIT_PRIVATE, 2);
+            state = state_.exchange(2, std::memory_order_acquire);
+        }
+    }
+    bool try_lock() {
+        int expected = 0;
+        return state_.compare_exchange_strong(expected, 1, std::memory_order_acquire,
+                                              std::memory_order_relaxed);
+    }
+    void unlock() {
+        if (state_.exchange(0, std::memory_order_release) == 2)
+            futex(FUTEX_WAKE_PRIVATE, 1);
+    }
+
+private:
+    static const int spin_limit = 100;
+
+    void futex(int op, int value) {
+        syscall(SYS_futex, reinterpret_cast<int*>(&state_), op, value, nullptr, nullptr, 0);
+    }
+
+    std::atomic<int> state_{0};
+    static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex needs a plain int");
+};